@@ -0,0 +1,359 @@
+/*
+ * capture2bin.c - turn a libmmcapture.so capture into an mdriver trace
+ *
+ * usage: capture2bin [-t] [-u] <in.cap> <out>
+ *   -t  write a text .rep trace instead of a binary one
+ *   -u  leave blocks still live at exit allocated (default: free them)
+ *
+ * The records are put back in call order by their sequence numbers and
+ * block addresses are replaced by trace ids. An id is recycled once its
+ * block is freed, so num_ids is the peak number of live blocks rather
+ * than the number of calls. Frees of blocks allocated before capture
+ * started are dropped, and an allocation that returns an address still
+ * believed live (its free was lost) first frees the old id. The
+ * suggested heap size is set to the peak number of live payload bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tracefmt.h"
+
+/* Open-addressed map from block address to trace id */
+typedef struct {
+    uint64_t ptr;               /* 0 = empty slot */
+    int id;
+} slot_t;
+
+static slot_t *slots;
+static size_t num_slots;        /* power of two */
+static size_t used_slots;
+
+static traceop_t *ops;          /* the trace being built */
+static int num_ops, max_ops;
+
+static int *id_size;            /* payload bytes of each live id */
+static int *free_ids;           /* stack of recycled ids */
+static int num_free_ids, num_ids, max_ids;
+static long live_bytes, peak_bytes;
+
+/* Per thread: the block in the middle of a realloc, if any */
+typedef struct {
+    uint64_t ptr;
+    int id;                     /* -1 if none, or never seen allocated */
+} pending_t;
+
+static pending_t *pending;
+static uint32_t num_threads;
+
+static void convert_error(char *path, char *msg)
+{
+    fprintf(stderr, "capture2bin: %s: %s\n", path, msg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "capture2bin: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/**********************
+ * Address -> id lookup
+ **********************/
+
+static size_t hash_ptr(uint64_t ptr)
+{
+    return (ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 20;
+}
+
+static void map_insert(uint64_t ptr, int id);
+
+static void map_grow(void)
+{
+    slot_t *old = slots;
+    size_t i, old_num = num_slots;
+
+    num_slots = old_num ? 2 * old_num : 1024;
+    slots = xrealloc(NULL, num_slots * sizeof(slot_t));
+    memset(slots, 0, num_slots * sizeof(slot_t));
+    used_slots = 0;
+    for (i = 0; i < old_num; i++)
+        if (old[i].ptr != 0)
+            map_insert(old[i].ptr, old[i].id);
+    free(old);
+}
+
+static void map_insert(uint64_t ptr, int id)
+{
+    size_t i;
+
+    if (2 * (used_slots + 1) > num_slots)
+        map_grow();
+    for (i = hash_ptr(ptr) & (num_slots - 1); slots[i].ptr != 0;
+         i = (i + 1) & (num_slots - 1))
+        ;
+    slots[i].ptr = ptr;
+    slots[i].id = id;
+    used_slots++;
+}
+
+/* map_remove - drop ptr from the map and return its id, or -1 */
+static int map_remove(uint64_t ptr)
+{
+    size_t i, j, k, mask = num_slots - 1;
+    int id;
+
+    if (num_slots == 0)
+        return -1;
+    for (i = hash_ptr(ptr) & mask; slots[i].ptr != ptr; i = (i + 1) & mask)
+        if (slots[i].ptr == 0)
+            return -1;
+    id = slots[i].id;
+
+    /* Backward-shift deletion keeps probe chains without tombstones */
+    for (j = (i + 1) & mask; slots[j].ptr != 0; j = (j + 1) & mask) {
+        k = hash_ptr(slots[j].ptr) & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].ptr = 0;
+    used_slots--;
+    return id;
+}
+
+/**************
+ * Trace output
+ **************/
+
+static void emit(int type, int id, int size)
+{
+    if (num_ops == max_ops) {
+        max_ops = max_ops ? 2 * max_ops : 4096;
+        ops = xrealloc(ops, max_ops * sizeof(traceop_t));
+    }
+    memset(&ops[num_ops], 0, sizeof(traceop_t));
+    ops[num_ops].type = type;
+    ops[num_ops].index = id;
+    ops[num_ops].size = size;
+    num_ops++;
+}
+
+static void set_size(int id, int size)
+{
+    live_bytes += size - id_size[id];
+    id_size[id] = size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+static int new_id(void)
+{
+    if (num_free_ids > 0)
+        return free_ids[--num_free_ids];
+    if (num_ids == max_ids) {
+        max_ids = max_ids ? 2 * max_ids : 1024;
+        id_size = xrealloc(id_size, max_ids * sizeof(int));
+        free_ids = xrealloc(free_ids, max_ids * sizeof(int));
+    }
+    id_size[num_ids] = 0;
+    return num_ids++;
+}
+
+static void release_id(int id)
+{
+    emit(FREE, id, 0);
+    set_size(id, 0);
+    free_ids[num_free_ids++] = id;
+}
+
+/* trace_size - mdriver wants positive int sizes; malloc(0) becomes 1 */
+static int trace_size(uint64_t size)
+{
+    if (size == 0)
+        return 1;
+    return size > INT_MAX ? INT_MAX : (int)size;
+}
+
+static void do_alloc(uint64_t ptr, uint64_t size)
+{
+    int id;
+
+    if ((id = map_remove(ptr)) >= 0)
+        release_id(id);
+    id = new_id();
+    emit(ALLOC, id, trace_size(size));
+    set_size(id, trace_size(size));
+    map_insert(ptr, id);
+}
+
+static pending_t *pending_slot(uint32_t thread)
+{
+    uint32_t i;
+
+    if (thread >= num_threads) {
+        pending = xrealloc(pending, (thread + 1) * sizeof(pending_t));
+        for (i = num_threads; i <= thread; i++)
+            pending[i].id = -1;
+        num_threads = thread + 1;
+    }
+    return &pending[thread];
+}
+
+static void replay(capture_rec *r)
+{
+    pending_t *p;
+    int id, live;
+
+    switch (r->type) {
+    case CAPTURE_ALLOC:
+        do_alloc(r->ptr, r->size);
+        break;
+    case CAPTURE_FREE:
+        if ((id = map_remove(r->ptr)) >= 0)
+            release_id(id);
+        break;
+    case CAPTURE_REALLOC_BEGIN:
+        /* The address is up for grabs until the realloc ends */
+        p = pending_slot(r->thread);
+        p->ptr = r->ptr;
+        p->id = map_remove(r->ptr);
+        break;
+    case CAPTURE_REALLOC_END:
+        p = pending_slot(r->thread);
+        id = p->id;
+        p->id = -1;
+        if (r->ptr == 0) {
+            /* Failed, so the old block is still there */
+            if (id >= 0)
+                map_insert(p->ptr, id);
+            break;
+        }
+        if (id < 0) {
+            do_alloc(r->ptr, r->size);
+            break;
+        }
+        if ((live = map_remove(r->ptr)) >= 0)
+            release_id(live);
+        emit(REALLOC, id, trace_size(r->size));
+        set_size(id, trace_size(r->size));
+        map_insert(r->ptr, id);
+        break;
+    }
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const capture_rec *)a)->seq;
+    uint64_t y = ((const capture_rec *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+static void write_trace(char *path, int text)
+{
+    FILE *out;
+    tracefile_hdr hdr;
+    int i;
+
+    if ((out = fopen(path, text ? "w" : "wb")) == NULL)
+        convert_error(path, strerror(errno));
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    hdr.sugg_heapsize = peak_bytes > INT_MAX ? INT_MAX : (int)peak_bytes;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.weight = 1;
+
+    if (text) {
+        fprintf(out, "%d\n%d\n%d\n%d\n", hdr.sugg_heapsize, hdr.num_ids,
+                hdr.num_ops, hdr.weight);
+        for (i = 0; i < num_ops; i++) {
+            if (ops[i].type == FREE)
+                fprintf(out, "f %d\n", ops[i].index);
+            else
+                fprintf(out, "%c %d %d\n", ops[i].type == ALLOC ? 'a' : 'r',
+                        ops[i].index, ops[i].size);
+        }
+    }
+    else {
+        if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+            fwrite(ops, sizeof(traceop_t), num_ops, out) != (size_t)num_ops)
+            convert_error(path, strerror(errno));
+    }
+    if (fclose(out) != 0)
+        convert_error(path, strerror(errno));
+}
+
+int main(int argc, char **argv)
+{
+    int c, fd, text = 0, balance = 1;
+    struct stat st;
+    char *map, *in, *out;
+    capture_rec *recs;
+    size_t i, n;
+
+    while ((c = getopt(argc, argv, "tu")) != EOF) {
+        switch (c) {
+        case 't':
+            text = 1;
+            break;
+        case 'u':
+            balance = 0;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-u] <in.cap> <out>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-t] [-u] <in.cap> <out>\n", argv[0]);
+        exit(1);
+    }
+    in = argv[optind];
+    out = argv[optind + 1];
+
+    if ((fd = open(in, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        convert_error(in, strerror(errno));
+    if (st.st_size < CAPTURE_MAGIC_LEN)
+        convert_error(in, "not a capture file");
+    /* A private writable mapping lets qsort work in place */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        convert_error(in, strerror(errno));
+    close(fd);
+    if (memcmp(map, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+        convert_error(in, "not a capture file");
+
+    /* A capture cut short may end in a partial record; ignore it */
+    recs = (capture_rec *)(map + CAPTURE_MAGIC_LEN);
+    n = (st.st_size - CAPTURE_MAGIC_LEN) / sizeof(capture_rec);
+    qsort(recs, n, sizeof(capture_rec), cmp_seq);
+    for (i = 0; i < n; i++)
+        replay(&recs[i]);
+
+    if (balance)
+        for (i = 0; i < num_slots; i++)
+            if (slots[i].ptr != 0)
+                release_id(slots[i].id);
+    if (num_ops == 0)
+        convert_error(in, "no requests captured");
+
+    write_trace(out, text);
+    printf("%s: %lu records -> %d ops, %d ids, peak %ld live bytes\n",
+           out, (unsigned long)n, num_ops, num_ids, peak_bytes);
+    munmap(map, st.st_size);
+    return 0;
+}
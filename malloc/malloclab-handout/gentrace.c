@@ -0,0 +1,391 @@
+/*
+ * gentrace.c - generate synthetic mdriver traces from distributions
+ *
+ * usage: gentrace [-t] [-n ops] [-p bytes] [-s dist] [-l dist] [-r frac]
+ *                 [-S seed] <out>
+ *   -n ops    total number of requests (default 100000)
+ *   -p bytes  peak live payload bytes (default 4194304)
+ *   -s dist   request sizes in bytes (default loguniform:1:4096)
+ *   -l dist   block lifetimes, counted in allocations (default exp:1000)
+ *   -r frac   fraction of requests that realloc a random live block
+ *   -S seed   random seed (default 1)
+ *   -t        write a text .rep trace instead of a binary one
+ *
+ * A distribution is one of
+ *   uniform:LO:HI     every value in [LO, HI] equally likely
+ *   loguniform:LO:HI  values in [LO, HI], every doubling equally likely
+ *   exp:MEAN          exponential with the given mean (at least 1)
+ *
+ * Each allocation draws a size and a lifetime; the block is freed once
+ * that many further allocations have been made. When an allocation
+ * would push the live bytes over the peak, the blocks due to die first
+ * are freed early to make room, so -p bounds the heap the trace needs.
+ * The trace is balanced, since whatever is still live once the op
+ * budget runs low is freed at the end, and has exactly -n requests.
+ * Ids are recycled as blocks die, so num_ids is the peak number of live
+ * blocks. The same seed always gives the same trace.
+ *
+ * Records are streamed out as they are made, so even traces of hundreds
+ * of millions of requests need memory only for the live blocks. The
+ * header is filled in at the end, so <out> must be a regular file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "tracefmt.h"
+
+typedef struct {
+    enum {DIST_UNIFORM, DIST_LOGUNIFORM, DIST_EXP} kind;
+    double a, b;                /* LO and HI, or MEAN */
+} dist_t;
+
+/* A pending death: block id dies once the clock reaches death */
+typedef struct {
+    unsigned long death;
+    int id;
+} death_t;
+
+static uint64_t rng_state;
+
+static death_t *deaths;         /* min-heap on death */
+static int num_deaths;
+
+static int *live_ids;           /* the live blocks, in no order */
+static int *live_pos;           /* index of each live id in live_ids */
+static int num_live;
+
+static int *id_size;            /* payload bytes of each live id */
+static int *free_ids;           /* stack of recycled ids */
+static int num_free_ids, num_ids, max_ids;
+static long live_bytes, peak_bytes;
+
+static char *prog = "gentrace";
+static FILE *out;
+static char *out_path;
+static int text;
+static long emitted;            /* requests written so far */
+
+static void gen_error(char *msg)
+{
+    fprintf(stderr, "gentrace: %s\n", msg);
+    exit(1);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+        gen_error("out of memory");
+    return p;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: %s [-t] [-n ops] [-p bytes] [-s dist] [-l dist]"
+            " [-r frac] [-S seed] <out>\n", prog);
+    fprintf(stderr, "  dist: uniform:LO:HI, loguniform:LO:HI or exp:MEAN\n");
+    exit(1);
+}
+
+/*********************************
+ * Random numbers and distributions
+ *********************************/
+
+/* splitmix64, so that a seed gives the same trace with any libc */
+static uint64_t next_rand(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* next_unit - uniform in [0, 1) */
+static double next_unit(void)
+{
+    return (next_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void parse_dist(char *arg, dist_t *d)
+{
+    char kind[16];
+    int n;
+
+    if (sscanf(arg, "%15[a-z]:%lf%n", kind, &d->a, &n) != 2)
+        usage();
+    if (strcmp(kind, "exp") == 0) {
+        d->kind = DIST_EXP;
+        if (arg[n] != '\0' || d->a < 1)
+            gen_error("exp needs a mean of at least 1");
+        return;
+    }
+    if (strcmp(kind, "uniform") == 0)
+        d->kind = DIST_UNIFORM;
+    else if (strcmp(kind, "loguniform") == 0)
+        d->kind = DIST_LOGUNIFORM;
+    else
+        usage();
+    if (sscanf(arg + n, ":%lf", &d->b) != 1 || d->a < 1 || d->b < d->a)
+        gen_error("a range needs 1 <= LO <= HI");
+}
+
+/* sample - draw a value of at least 1 from a distribution */
+static double sample(dist_t *d)
+{
+    double x;
+
+    switch (d->kind) {
+    case DIST_UNIFORM:
+        x = floor(d->a + next_unit() * (d->b - d->a + 1));
+        break;
+    case DIST_LOGUNIFORM:
+        x = floor(exp(log(d->a) + next_unit() * (log(d->b + 1) - log(d->a))));
+        break;
+    default:
+        x = ceil(-d->a * log(1.0 - next_unit()));
+        break;
+    }
+    return x < 1 ? 1 : x;
+}
+
+static int sample_size(dist_t *d)
+{
+    double x = sample(d);
+
+    return x > INT_MAX ? INT_MAX : (int)x;
+}
+
+/**************
+ * Trace output
+ **************/
+
+static void emit(int type, int id, int size)
+{
+    traceop_t op;
+
+    if (text) {
+        if (type == FREE)
+            fprintf(out, "f %d\n", id);
+        else
+            fprintf(out, "%c %d %d\n", type == ALLOC ? 'a' : 'r', id, size);
+    }
+    else {
+        memset(&op, 0, sizeof(op));
+        op.type = type;
+        op.index = id;
+        op.size = size;
+        fwrite(&op, sizeof(op), 1, out);
+    }
+    emitted++;
+}
+
+/* write_header - the header, padded so that the final one fits over it */
+static void write_header(int num_ops)
+{
+    tracefile_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    hdr.sugg_heapsize = peak_bytes > INT_MAX ? INT_MAX : (int)peak_bytes;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.weight = 1;
+
+    if (text)
+        fprintf(out, "%-11d\n%-11d\n%-11d\n%-11d\n", hdr.sugg_heapsize,
+                hdr.num_ids, hdr.num_ops, hdr.weight);
+    else
+        fwrite(&hdr, sizeof(hdr), 1, out);
+}
+
+/***************
+ * Live blocks
+ ***************/
+
+static void push_death(unsigned long death, int id)
+{
+    int i = num_deaths++, parent;
+
+    while (i > 0 && deaths[parent = (i - 1) / 2].death > death) {
+        deaths[i] = deaths[parent];
+        i = parent;
+    }
+    deaths[i].death = death;
+    deaths[i].id = id;
+}
+
+static int pop_death(void)
+{
+    int id = deaths[0].id, i = 0, child;
+    death_t last = deaths[--num_deaths];
+
+    while ((child = 2 * i + 1) < num_deaths) {
+        if (child + 1 < num_deaths && deaths[child + 1].death < deaths[child].death)
+            child++;
+        if (deaths[child].death >= last.death)
+            break;
+        deaths[i] = deaths[child];
+        i = child;
+    }
+    deaths[i] = last;
+    return id;
+}
+
+static void set_size(int id, int size)
+{
+    live_bytes += size - id_size[id];
+    id_size[id] = size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+static void do_alloc(int size, unsigned long death)
+{
+    int id;
+
+    if (num_free_ids > 0) {
+        id = free_ids[--num_free_ids];
+    }
+    else {
+        if (num_ids == max_ids) {
+            max_ids = max_ids ? 2 * max_ids : 1024;
+            id_size = xrealloc(id_size, max_ids * sizeof(int));
+            free_ids = xrealloc(free_ids, max_ids * sizeof(int));
+            live_ids = xrealloc(live_ids, max_ids * sizeof(int));
+            live_pos = xrealloc(live_pos, max_ids * sizeof(int));
+            deaths = xrealloc(deaths, max_ids * sizeof(death_t));
+        }
+        id = num_ids++;
+    }
+    id_size[id] = 0;
+    live_pos[id] = num_live;
+    live_ids[num_live++] = id;
+    push_death(death, id);
+    emit(ALLOC, id, size);
+    set_size(id, size);
+}
+
+/* do_free - free the live block due to die first */
+static void do_free(void)
+{
+    int id = pop_death();
+    int last = live_ids[--num_live];
+
+    live_ids[live_pos[id]] = last;
+    live_pos[last] = live_pos[id];
+    emit(FREE, id, 0);
+    set_size(id, 0);
+    free_ids[num_free_ids++] = id;
+}
+
+/* do_realloc - resize a random live block, staying under the peak */
+static void do_realloc(dist_t *sizes, long peak)
+{
+    int id = live_ids[next_rand() % num_live];
+    int size = sample_size(sizes);
+
+    if (live_bytes - id_size[id] + size > peak)
+        size = (peak - (live_bytes - id_size[id]) > 0) ?
+            (int)(peak - (live_bytes - id_size[id])) : 1;
+    emit(REALLOC, id, size);
+    set_size(id, size);
+}
+
+int main(int argc, char **argv)
+{
+    dist_t sizes = {DIST_LOGUNIFORM, 1, 4096};
+    dist_t lifetimes = {DIST_EXP, 1000, 0};
+    long num_ops = 100000, peak = 4L << 20, slack;
+    double realloc_frac = 0;
+    unsigned long clock = 0;
+    int c, size;
+
+    prog = argv[0];
+    rng_state = 1;
+    while ((c = getopt(argc, argv, "tn:p:s:l:r:S:")) != EOF) {
+        switch (c) {
+        case 't':
+            text = 1;
+            break;
+        case 'n':
+            num_ops = atol(optarg);
+            break;
+        case 'p':
+            peak = atol(optarg);
+            break;
+        case 's':
+            parse_dist(optarg, &sizes);
+            break;
+        case 'l':
+            parse_dist(optarg, &lifetimes);
+            break;
+        case 'r':
+            realloc_frac = atof(optarg);
+            break;
+        case 'S':
+            rng_state = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1)
+        usage();
+    if (num_ops < 2 || num_ops > INT_MAX)
+        gen_error("the op count must be between 2 and INT_MAX");
+    if (peak < 1)
+        gen_error("the peak must be at least one byte");
+    if (realloc_frac < 0 || realloc_frac >= 1)
+        gen_error("the realloc fraction must be in [0, 1)");
+
+    out_path = argv[optind];
+    if ((out = fopen(out_path, text ? "w" : "wb")) == NULL) {
+        fprintf(stderr, "gentrace: %s: %s\n", out_path, strerror(errno));
+        exit(1);
+    }
+    write_header(0);
+
+    /*
+     * Every allocation needs a matching free within the budget, so
+     * slack is what is left once the live blocks are paid for. A free
+     * leaves it unchanged; with one op to spare, a realloc uses it up.
+     */
+    while ((slack = num_ops - (emitted + num_live)) > 0) {
+        if (num_live > 0 && slack == 1) {
+            do_realloc(&sizes, peak);
+        }
+        else if (num_live > 0 && deaths[0].death <= clock) {
+            do_free();
+        }
+        else if (num_live > 0 && next_unit() < realloc_frac) {
+            do_realloc(&sizes, peak);
+        }
+        else {
+            size = sample_size(&sizes);
+            while (num_live > 0 && live_bytes + size > peak)
+                do_free();
+            do_alloc(size, clock + (unsigned long)sample(&lifetimes));
+            clock++;
+        }
+    }
+    while (num_live > 0)
+        do_free();
+
+    if (fseek(out, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "gentrace: %s: %s\n", out_path, strerror(errno));
+        exit(1);
+    }
+    write_header((int)emitted);
+    if (ferror(out) || fclose(out) != 0) {
+        fprintf(stderr, "gentrace: %s: write failed\n", out_path);
+        exit(1);
+    }
+    printf("%s: %ld ops, %d ids, peak %ld live bytes\n",
+           out_path, emitted, num_ids, peak_bytes);
+    return 0;
+}
@@ -17,12 +17,24 @@
 #include <math.h>
 #include <inttypes.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <malloc.h>
+#include <search.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "pagemap.h"
 #include "fsecs.h"
 #include "config.h"
+#include "tracefmt.h"
+#include "perfctr.h"
 
 /**********************
  * Constants and macros
@@ -36,24 +48,47 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
+/* TLB benchmark (-H): block sizes and passes over the heap */
+#define TLB_MIN_BLOCK   16
+#define TLB_MAX_BLOCK 1024
+#define TLB_PASSES       4
+
+/* Latency histograms (-L): 2^LAT_SUB_BITS buckets per power of two */
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS  (64 << LAT_SUB_BITS)
+#define LAT_OP_TYPES 3   /* one histogram each for ALLOC, FREE, REALLOC */
+
+/* Payload patterns: byte j of the payload of block index with -I */
+#define PATTERN(index, j) \
+    ((char)((((unsigned)(index) * 0x9E3779B1u) ^ ((unsigned)(j) * 0x85EBCA77u)) >> 24))
+
+/* The byte replay thread t fills block index with, distinct for every
+   thread on the same index, for up to 256 threads */
+#define REPLAY_FILL(t, index) ((char)((unsigned)(index) + (unsigned)(t) * 0x9Du))
+
+/* Random traces for the fuzzer (-z) */
+#define FUZZ_OPS     2000      /* requests per random trace */
+#define FUZZ_LARGE   (1 << 18) /* largest request size */
+#define FUZZ_TIMEOUT 10        /* seconds before a run counts as hung */
+
+/* Producer/consumer benchmark (-Q) */
+#define PC_RING     256 /* blocks in flight from producer to consumer */
+#define PC_MAX_SIZE 256 /* largest payload the producer asks for */
+#define PC_SIZE(i)  (1 + (int)(((unsigned)(i) * 2654435761u) % PC_MAX_SIZE))
+
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
-typedef struct range_t {
+/* 
+ * Records the extent of each block's payload. The records of a trace
+ * live in a tsearch tree (its root is a void *) ordered by address.
+ */
+typedef struct {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -63,6 +98,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapped binary trace that ops points into, or NULL */
+    size_t map_size;     /* length of that mapping */
 } trace_t;
 
 /* 
@@ -72,9 +109,54 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;  
-    range_t *ranges;
+    void *ranges;
+    struct backend *backend;  /* the allocator timed by eval_backend_speed */
 } speed_t;
 
+/* Holds the params to eval_mm_threads, which is timed by fsecs */
+typedef struct {
+    trace_t *trace;
+    int num_threads;  /* number of threads replaying the trace at once */
+    int arenas;       /* if set, bind thread t to mm arena t (-A) */
+    int check;        /* fill and verify payloads while replaying? */
+    int errors;       /* corrupted or misaligned payloads seen by any thread */
+} threads_t;
+
+/* One replaying thread's private view of a trace */
+typedef struct {
+    trace_t *trace;
+    int thread;           /* this thread's number, mixed into its fills */
+    int check;
+    int cpu;              /* the CPU whose arena to use, or -1 */
+    pthread_barrier_t *start;
+    char **blocks;        /* this thread's own block pointers... */
+    size_t *block_sizes;  /* ... and payload sizes */
+    int errors;
+} replay_t;
+
+/*
+ * Holds the params to eval_prodcons, which is timed by fsecs. The
+ * producer pushes the blocks it allocates on a ring in the order it
+ * made them, and the consumer pops and frees them in that order.
+ */
+typedef struct {
+    int num_blocks;   /* blocks the producer hands to the consumer */
+    int arenas;       /* give producer and consumer arenas of their own? */
+    int libc;         /* time libc malloc instead of mm? */
+    int check;        /* check the mm heap once both threads are done? */
+    int errors;       /* corrupted payloads or heap errors seen */
+    char *ring[PC_RING];
+    unsigned long head;  /* blocks pushed by the producer... */
+    unsigned long tail;  /* ... and popped by the consumer */
+} prodcons_t;
+
+/* Histogram of the cycles taken by calls of one kind */
+typedef struct {
+    uint64_t count[LAT_BUCKETS]; /* calls per log-spaced bucket */
+    uint64_t n;                  /* calls timed */
+    uint64_t max;                /* slowest call */
+} lat_hist_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -87,9 +169,49 @@ typedef struct {
 
     double inst_util;     /* instanteous space utilization for this trace (always 0 for libc) */
 
+    long long events[PERFCTR_NUM_EVENTS]; /* event counts of one replay (-P), or -1 */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a -j worker process sends back over its pipe for one trace */
+typedef struct {
+    stats_t stats;
+    int errors;                      /* errors the worker reported */
+    lat_hist_t lat[LAT_OP_TYPES];    /* filled in only with -L */
+    pagemap_usage pm_usage;
+} job_result_t;
+
+/*
+ * An allocator that -B compares: mm.c in one of its modes, or libc.
+ * Adding a row to backends[] below is all it takes to compare another
+ * allocator linked into the driver.
+ */
+typedef struct backend {
+    char *name;
+    int (*init)(void);                        /* start a fresh heap, or -1 */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*reset)(void);  /* drop the whole heap, or NULL to free each block */
+    size_t (*heap_size)(void);                /* bytes taken from the system */
+} backend_t;
+
+/* What a -B worker process sends back for one backend on one trace */
+typedef struct {
+    stats_t stats;
+    uint64_t p50, p99, max;  /* request latency in cycles */
+    long rss_kb;             /* growth of the peak resident set */
+} backend_result_t;
+
+/* Holds the params to backend_thread */
+typedef struct {
+    speed_t params;             /* trace and backend, also for fsecs */
+    backend_result_t *result;
+    lat_hist_t *lat;            /* all of the backend's requests */
+    int tracenum;               /* for the validity check's errors */
+} backend_run_t;
+
 /********************
  * Global variables
  *******************/
@@ -97,6 +219,29 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* If set, eval_mm_util logs instantaneous utilization here (-u) */
+static FILE *util_log = NULL;
+
+/* If set, eval_mm_valid runs mm_check(1) every check_every ops and
+   mm_check(0) after all the others (-c) */
+static int check_every = 0;
+
+/* If set, eval_mm_valid fills payloads with PATTERN and checks them
+   before every free and realloc (-I, and always when fuzzing) */
+static int pattern_check = 0;
+
+/* If set, eval_mm_util prints mm_get_stats at peak heap and at the end (-s) */
+static int dump_stats = 0;
+
+/* If set, eval_mm_trace counts hardware events over one more replay (-P) */
+static perfctr_set *counters = NULL;
+
+/* Cost of reading the cycle counter, taken off every timed call (-L) */
+static uint64_t tsc_overhead = 0;
+
+/* What libc held before a -B worker started replaying */
+static size_t libc_base = 0;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -110,14 +255,15 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate the range index */
+static int add_range(void **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(void **ranges, char *lo);
+static void clear_ranges(void **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_binary_trace(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -126,17 +272,83 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio);
+static int eval_mm_valid(trace_t *trace, int tracenum, void **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, void **ranges, double *inst_ratio);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_trace(char *tracefile, int tracenum, stats_t *stats,
+			  lat_hist_t *lat);
+static void run_mm_jobs(char **tracefiles, int num_tracefiles, int jobs,
+			stats_t *stats, lat_hist_t *lat, pagemap_usage *pm);
+static void eval_mm_latency(trace_t *trace, lat_hist_t *lat);
+static void eval_tlb(int megabytes);
+static void fill_payload(char *p, int index, int size);
+static int check_payload(char *p, int index, int size);
+
+/* These functions compare the allocators in backends[] (-B) */
+static int mm_deferred_init(void);
+static int libc_init(void);
+static size_t libc_heapsize(void);
+static void eval_backends(char **tracefiles, int num_tracefiles,
+			  backend_result_t *results);
+static void eval_backend(backend_t *b, trace_t *trace, int tracenum,
+			 backend_result_t *result);
+static int eval_backend_valid(backend_t *b, trace_t *trace, int tracenum);
+static double eval_backend_util(backend_t *b, trace_t *trace,
+				double *inst_ratio);
+static void eval_backend_speed(void *ptr);
+static void eval_backend_latency(backend_t *b, trace_t *trace,
+				 lat_hist_t *lat);
+static void backend_release(backend_t *b, trace_t *trace);
+static void *backend_thread(void *ptr);
+static long status_kb(char *name);
+static void lat_calibrate(void);
+
+/* These functions fuzz the mm package with random traces */
+static int fuzz_mm(uint64_t seed, long rounds);
+static int fuzz_trace(uint64_t seed, traceop_t *ops);
+static int fuzz_select(traceop_t *ops, int num_ops, char *keep,
+		       traceop_t *out, int *num_ids);
+static int fuzz_run(traceop_t *ops, int num_ops, int num_ids, int quiet);
+static int fuzz_shrink(traceop_t *ops, int num_ops, char *keep, int *runs);
+static void write_rep_trace(char *path, traceop_t *ops, int num_ops,
+			    int num_ids);
+
+/* Routines for replaying a trace from several threads at once */
+static void eval_mm_threads(void *ptr);
+static void *replay_trace(void *ptr);
+static int replay_filled(char *p, char fill, size_t size);
+
+/* Routines for the producer/consumer benchmark */
+static void eval_prodcons(void *ptr);
+static void *produce(void *ptr);
+static void *consume(void *ptr);
+static void printprodcons(int num_blocks, int n, char **names, stats_t *stats);
+static void printthreadresults(int n, int num_threads, stats_t *one_stats,
+                               stats_t *many_stats);
+static void printdeferredresults(int n, stats_t *now_stats,
+                                 stats_t *later_stats);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printbackendresults(int n, char **tracefiles,
+				backend_result_t *results, FILE *csv);
+static void printlatency(int n, lat_hist_t *lat);
+static void printevents(int n, stats_t *stats);
+static void print_mm_stats(int tracenum, char *when, int opnum, mm_stats_t *st);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
 
+/* The allocators compared by -B */
+static backend_t backends[] = {
+    {"mm", mm_init, mm_malloc, mm_free, mm_realloc, mem_reset, mem_heapsize},
+    {"mm-deferred", mm_deferred_init, mm_malloc, mm_free, mm_realloc,
+     mem_reset, mem_heapsize},
+    {"libc", libc_init, malloc, free, realloc, NULL, libc_heapsize},
+};
+#define NUM_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
 /**************
  * Main routine
  **************/
@@ -147,13 +359,32 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
+    threads_t thread_params;   /* input parameters to eval_mm_threads */
+    stats_t *one_stats = NULL; /* threaded mm stats with one thread... */
+    stats_t *many_stats = NULL;/* ... and with num_threads threads */
+    stats_t *deferred_stats = NULL; /* mm stats with deferred coalescing (-D) */
+    lat_hist_t *mm_lat = NULL; /* LAT_OP_TYPES histograms per trace (-L) */
+    pagemap_usage pm_usage;    /* pagemap bookkeeping, reported with -v */
+    perfctr_set event_counters;/* hardware counters for -P */
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int num_threads = 0; /* If set, replay traces from this many threads (-T) */
+    int num_arenas = 0;  /* If set, split mm's threaded heap into this many arenas (-A) */
+    int latency = 0;     /* If set, time every mm call separately (-L) */
+    int tlb_mb = 0;      /* If set, run the TLB benchmark on this many MB (-H) */
+    int jobs = 1;        /* Evaluate up to this many traces at once (-j) */
+    int compare_deferred = 0; /* If set, rerun with deferred coalescing (-D) */
+    int compare_backends = 0; /* If set, compare every backend (-B) */
+    int prodcons = 0;    /* If set, pass this many blocks between two threads (-Q) */
+    FILE *csv = NULL;    /* ... and write the comparison here as CSV (-C) */
+    backend_result_t *backend_results = NULL;
+    int fuzz = 0;        /* If set, fuzz mm malloc with random traces (-z) */
+    uint64_t fuzz_seed = 0;   /* ... starting from this seed */
+    long fuzz_rounds = 0;     /* ... for this many traces, or until one fails (-Z) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, inst_util, avg_mm_inst_util, avg_mm_util, avg_mm_throughput;
@@ -163,7 +394,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalLT:A:Q:u:c:H:j:sDPIz:Z:BC:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -186,6 +417,91 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'H': /* Compare TLB behavior with and without huge pages */
+            tlb_mb = atoi(optarg);
+            if (tlb_mb < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'j': /* Evaluate traces in parallel worker processes */
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'B': /* Compare every allocator backend */
+            compare_backends = 1;
+            break;
+        case 'C': /* Write the backend comparison as CSV */
+            if ((csv = fopen(optarg, "w")) == NULL) {
+                sprintf(msg, "Could not open %s for -C", optarg);
+                unix_error(msg);
+            }
+            compare_backends = 1;
+            break;
+        case 'D': /* Compare immediate and deferred coalescing */
+            compare_deferred = 1;
+            break;
+        case 'I': /* Check payload patterns on every free and realloc */
+            pattern_check = 1;
+            break;
+        case 'z': /* Fuzz with random traces, starting from this seed */
+            fuzz = 1;
+            fuzz_seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'Z': /* Stop fuzzing after this many traces */
+            fuzz_rounds = atol(optarg);
+            if (fuzz_rounds < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'L': /* Per-call latency histograms */
+            latency = 1;
+            break;
+        case 'P': /* Count hardware events for each trace */
+            counters = &event_counters;
+            break;
+        case 's': /* Dump the package's heap statistics for each trace */
+            dump_stats = 1;
+            break;
+        case 'T': /* Replay each trace concurrently from several threads */
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'A': /* Give the threads of -T arenas of their own */
+            num_arenas = atoi(optarg);
+            if (num_arenas < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'Q': /* Time a producer and a consumer thread */
+            prodcons = atoi(optarg);
+            if (prodcons < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'u': /* Log instantaneous utilization after every op */
+            if ((util_log = fopen(optarg, "w")) == NULL) {
+                sprintf(msg, "Could not open %s for -u", optarg);
+                unix_error(msg);
+            }
+            fprintf(util_log, "trace op live_bytes heap_bytes inst_util\n");
+            break;
+        case 'c': /* Check heap consistency while validating */
+            check_every = atoi(optarg);
+            if (check_every < 1) {
+                usage();
+                exit(1);
+            }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -201,6 +517,20 @@ int main(int argc, char **argv)
         }
     }
 	
+    /* Workers would interleave their lines in the -u log */
+    if (jobs > 1 && util_log)
+	app_error("The -u and -j options cannot be combined");
+
+    /* Only the threads of -T are given arenas */
+    if (num_arenas && !num_threads)
+	app_error("The -A option needs -T");
+
+    /* Fuzzing replaces the usual evaluation */
+    if (fuzz) {
+	mem_init();
+	exit(fuzz_mm(fuzz_seed, fuzz_rounds));
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -259,34 +589,206 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (latency) {
+	mm_lat = (lat_hist_t *)calloc(num_tracefiles * LAT_OP_TYPES,
+				      sizeof(lat_hist_t));
+	if (mm_lat == NULL)
+	    unix_error("mm_lat calloc in main failed");
+    }
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
+    if (counters && perfctr_open_set(counters) == 0)
+	printf("No hardware event counters are available for -P\n");
+
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i].inst_util);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+    if (jobs > 1) {
+	run_mm_jobs(tracefiles, num_tracefiles, jobs, mm_stats, mm_lat,
+		    &pm_usage);
+    }
+    else {
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracefiles[i], i, &mm_stats[i],
+			  latency ? &mm_lat[i * LAT_OP_TYPES] : NULL);
+	pagemap_get_usage(&pm_usage);
     }
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
+	printf("pagemap: peak %lu pages mapped, %lu KB tables + %lu KB bitmaps"
+	       " + %lu KB page info\n", (unsigned long)pm_usage.peak_mapped,
+	       (unsigned long)pm_usage.tables / 1024,
+	       (unsigned long)pm_usage.bitmaps / 1024,
+	       (unsigned long)pm_usage.info / 1024);
+	printf("\n");
+    }
+    if (latency) {
+	printf("Latency of mm malloc calls (cycles):\n");
+	printlatency(num_tracefiles, mm_lat);
+	printf("\n");
+    }
+    if (counters) {
+	printf("Hardware events per mm malloc request:\n");
+	printevents(num_tracefiles, mm_stats);
+	printf("\n");
+	perfctr_close_set(counters);
+    }
+
+    /*
+     * Optionally replay each trace from num_threads threads at once in
+     * the package's thread-safe mode, and compare with a single thread
+     */
+    if (num_threads) {
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with %d threads\n", num_threads);
+
+	one_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	many_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (one_stats == NULL || many_stats == NULL)
+	    unix_error("thread stats calloc in main failed");
+
+	mm_set_threaded(1);
+	mm_set_arenas(num_arenas ? num_arenas : 1);
+	thread_params.arenas = num_arenas;
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    thread_params.trace = trace;
+
+	    /* First a checked run, then the timed ones */
+	    thread_params.num_threads = num_threads;
+	    thread_params.check = 1;
+	    thread_params.errors = 0;
+	    eval_mm_threads(&thread_params);
+	    if (thread_params.errors) {
+		sprintf(msg, "%d corrupted or misaligned payloads with %d threads",
+			thread_params.errors, num_threads);
+		malloc_error(i, 0, msg);
+	    }
+	    else {
+		thread_params.check = 0;
+		thread_params.num_threads = 1;
+		one_stats[i].valid = 1;
+		one_stats[i].ops = trace->num_ops;
+		one_stats[i].secs = fsecs(eval_mm_threads, &thread_params);
+		thread_params.num_threads = num_threads;
+		many_stats[i].valid = 1;
+		many_stats[i].ops = (double)trace->num_ops * num_threads;
+		many_stats[i].secs = fsecs(eval_mm_threads, &thread_params);
+	    }
+	    free_trace(trace);
+	}
+	mm_set_arenas(1);
+	mm_set_threaded(0);
+
+	if (num_arenas)
+	    printf("\nResults for mm malloc with %d threads and %d arenas:\n",
+		   num_threads, num_arenas);
+	else
+	    printf("\nResults for mm malloc with %d threads:\n", num_threads);
+	printthreadresults(num_tracefiles, num_threads, one_stats, many_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally time a producer thread that allocates blocks and a
+     * consumer thread that frees them, with mm's threads sharing one
+     * arena, with an arena each, and with libc malloc
+     */
+    if (prodcons) {
+	char *pc_names[] = {"mm, 1 arena", "mm, 2 arenas", "libc"};
+	stats_t pc_stats[3];
+	prodcons_t pc;
+
+	if (verbose > 1)
+	    printf("\nTesting producer/consumer with %d blocks\n", prodcons);
+
+	memset(pc_stats, 0, sizeof(pc_stats));
+	mm_set_threaded(1);
+	for (i = 0; i < 3; i++) {
+	    memset(&pc, 0, sizeof(pc));
+	    pc.num_blocks = prodcons;
+	    pc.arenas = (i == 1);
+	    pc.libc = (i == 2);
+	    mm_set_arenas(pc.arenas ? 2 : 1);
+
+	    /* First a checked run, then the timed ones */
+	    pc.check = 1;
+	    eval_prodcons(&pc);
+	    if (pc.errors) {
+		errors++;
+		printf("ERROR [producer/consumer, %s]: %d corrupted payloads or heap errors\n",
+		       pc_names[i], pc.errors);
+		continue;
+	    }
+	    pc.check = 0;
+	    pc_stats[i].valid = 1;
+	    pc_stats[i].ops = 2.0 * prodcons;
+	    pc_stats[i].secs = fsecs(eval_prodcons, &pc);
+	}
+	mm_set_arenas(1);
+	mm_set_threaded(0);
+
+	printf("\nResults for a producer and a consumer thread:\n");
+	printprodcons(prodcons, 3, pc_names, pc_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally evaluate every trace again with deferred coalescing
+     * and compare with the immediate coalescing results above
+     */
+    if (compare_deferred) {
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with deferred coalescing\n");
+
+	deferred_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (deferred_stats == NULL)
+	    unix_error("deferred_stats calloc in main failed");
+
+	mm_set_deferred(1);
+	if (jobs > 1) {
+	    run_mm_jobs(tracefiles, num_tracefiles, jobs, deferred_stats,
+			NULL, &pm_usage);
+	}
+	else {
+	    for (i=0; i < num_tracefiles; i++)
+		eval_mm_trace(tracefiles[i], i, &deferred_stats[i], NULL);
+	}
+	mm_set_deferred(0);
+
+	printf("\nResults for mm malloc with immediate vs deferred coalescing:\n");
+	printdeferredresults(num_tracefiles, mm_stats, deferred_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally compare every allocator in backends[] on each trace
+     */
+    if (compare_backends) {
+	if (verbose > 1)
+	    printf("\nComparing allocator backends\n");
+
+	backend_results = (backend_result_t *)calloc(num_tracefiles * NUM_BACKENDS,
+						     sizeof(backend_result_t));
+	if (backend_results == NULL)
+	    unix_error("backend_results calloc in main failed");
+
+	eval_backends(tracefiles, num_tracefiles, backend_results);
+
+	printf("\nResults for each allocator (latency in cycles, "
+	       "peak RSS growth in KB):\n");
+	printbackendresults(num_tracefiles, tracefiles, backend_results, csv);
+	printf("\n");
+	if (csv)
+	    fclose(csv);
+    }
+
+    if (tlb_mb) {
+	printf("\nTLB benchmark for mm malloc:\n");
+	eval_tlb(tlb_mb);
 	printf("\n");
     }
 
@@ -343,27 +845,49 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    if (util_log)
+	fclose(util_log);
+
     exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range index, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range index to detect any overlapping allocated blocks. It is a
+ * balanced tsearch tree in which overlapping ranges compare equal,
+ * so a lookup finds a clash in O(log n) and validity checking stays
+ * fast on traces with millions of requests and live blocks.
  ****************************************************************/
 
+/*
+ * range_cmp - Order disjoint ranges by address; overlapping ranges
+ *     compare equal. The ranges in the index never overlap, so this
+ *     is a consistent order for the tree.
+ */
+static int range_cmp(const void *a, const void *b)
+{
+    const range_t *x = a, *y = b;
+
+    if (x->hi < y->lo)
+	return -1;
+    if (x->lo > y->hi)
+	return 1;
+    return 0;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the index. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(void **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *q;
     char msg[MAXLINE];
     size_t page_size = mem_pagesize(), i;
 
@@ -393,61 +917,57 @@ static int add_range(range_t **ranges, char *lo, int size,
       return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
-    }
-
     /* 
-     * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * Insert the block's range. If tsearch hands back another record
+     * instead, that payload overlaps this one.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    if ((q = tsearch(p, ranges, range_cmp)) == NULL)
+	unix_error("tsearch error in add_range");
+    q = *(range_t **)q;
+    if (q != p) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, q->lo, q->hi);
+	malloc_error(tracenum, opnum, msg);
+	free(p);
+	return 0;
+    }
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(void **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    range_t key, *p;
+    void *node;
+
+    key.lo = key.hi = lo;
+    if ((node = tfind(&key, ranges, range_cmp)) == NULL)
+	return;
+    p = *(range_t **)node;
+    if (p->lo != lo)
+	return;
+    tdelete(p, ranges, range_cmp);
+    free(p);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(void **ranges)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    while (*ranges != NULL) {
+	p = *(range_t **)*ranges;    /* the root node's key */
+	tdelete(p, ranges, range_cmp);
+	free(p);
     }
-    *ranges = NULL;
 }
 
 
@@ -474,10 +994,16 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
+    trace->map = NULL;
 	
-    /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
+
+    /* Binary traces are mapped rather than parsed */
+    if (map_binary_trace(trace, path))
+	return trace;
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
@@ -541,13 +1067,89 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_binary_trace - If the file at path is a binary trace (see
+ *     tracefmt.h), map it read-only and point trace->ops straight at
+ *     its records. Returns 0 if the file is a text trace.
+ */
+static int map_binary_trace(trace_t *trace, char *path)
+{
+    int fd, i;
+    struct stat st;
+    tracefile_hdr *hdr;
+    char magic[TRACE_MAGIC_LEN];
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    if (read(fd, magic, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN
+	|| memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+	close(fd);
+	return 0;
+    }
+
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat failed in map_binary_trace");
+    if (st.st_size < sizeof(tracefile_hdr))
+	app_error("Binary trace is shorter than its header");
+
+    /* Prefault the pages so that the timed runs do not pay for it */
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ,
+		      MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in map_binary_trace");
+    close(fd);
+
+    hdr = (tracefile_hdr *)trace->map;
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = (traceop_t *)(hdr + 1);
+
+    if (trace->num_ops < 0 || trace->num_ids <= 0
+	|| trace->map_size != sizeof(tracefile_hdr)
+	                      + (size_t)trace->num_ops * sizeof(traceop_t)) {
+	sprintf(msg, "Binary trace %s does not match its header", path);
+	app_error(msg);
+    }
+
+    /* The records are used unparsed, but a bad index must not run
+       off the end of the blocks array */
+    for (i = 0; i < trace->num_ops; i++) {
+	if ((unsigned)trace->ops[i].index >= (unsigned)trace->num_ids
+	    || (unsigned)trace->ops[i].type > REALLOC) {
+	    sprintf(msg, "Bogus request %d in binary trace %s", i, path);
+	    app_error(msg);
+	}
+    }
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in map_binary_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in map_binary_trace");
+
+    if (verbose > 1)
+	printf("Mapped binary tracefile: %s (%d ops)\n", path, trace->num_ops);
+
+    return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(). The
+ *              ops of a binary trace are unmapped instead.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map)           /* free the three arrays... */
+	munmap(trace->map, trace->map_size);
+    else
+	free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -558,19 +1160,52 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * fill_payload - Fill the payload of block index with its pattern: the
+ *     low byte of index, or PATTERN with -I so that a payload copied or
+ *     shifted onto another is caught as well
+ */
+static void fill_payload(char *p, int index, int size)
+{
+    int j;
+
+    if (!pattern_check) {
+	memset(p, index & 0xFF, size);
+	return;
+    }
+    for (j = 0; j < size; j++)
+	p[j] = PATTERN(index, j);
+}
+
+/*
+ * check_payload - Return the offset of the first byte of the payload
+ *     of block index that no longer holds its pattern, or -1
+ */
+static int check_payload(char *p, int index, int size)
+{
+    int j;
+
+    for (j = 0; j < size; j++)
+	if (p[j] != (pattern_check ? PATTERN(index, j) : (char)(index & 0xFF)))
+	    return j;
+    return -1;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, void **ranges) 
 {
-    int i;
+    int i, j;
     int index;
     int size;
+    int oldsize;
+    int reallocs = 0, in_place = 0;
     char *newp;
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range index */
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
@@ -596,7 +1231,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range index if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -607,32 +1242,53 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     * if we realloc the block and wish to make sure that the old
 	     * data was copied to the new block
 	     */
-	    memset(p, index & 0xFF, size);
+	    fill_payload(p, index, size);
 
 	    /* Remember region */
 	    trace->blocks[index] = p;
 	    trace->block_sizes[index] = size;
 	    break;
 
-        case REALLOC: /* mm_malloc + mm_free */
+        case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+	    oldsize = trace->block_sizes[index];
+	    if (pattern_check &&
+		(j = check_payload(oldp, index, oldsize)) >= 0) {
+		sprintf(msg, "Payload (%p:%p) was overwritten at offset %d "
+			"before mm_realloc", oldp, oldp + oldsize - 1, j);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
+	    reallocs++;
+	    if (newp == oldp)
+		in_place++;
 
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range index */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range index */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 
-	    memset(newp, index & 0xFF, size);
-
-            mm_free(oldp);
+	    /* ADDED: cgw
+	     * Make sure that the new block contains the data from the old 
+	     * block and then fill in the new block with the low order byte
+	     * of the new index
+	     */
+	    if (size < oldsize)
+		oldsize = size;
+	    if (check_payload(newp, index, oldsize) >= 0) {
+		malloc_error(tracenum, i, "mm_realloc did not preserve the "
+			     "data from old block");
+		return 0;
+	    }
+	    fill_payload(newp, index, size);
 
 	    /* Remember region */
 	    trace->blocks[index] = newp;
@@ -643,6 +1299,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
+	    size = trace->block_sizes[index];
+	    if (pattern_check && (j = check_payload(p, index, size)) >= 0) {
+		sprintf(msg, "Payload (%p:%p) was overwritten at offset %d "
+			"before mm_free", p, p + size - 1, j);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
 	    remove_range(ranges, p);
 	    mm_free(p);
 	    break;
@@ -651,10 +1314,19 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Optionally check the heap, deeply every check_every ops */
+	if (check_every && !mm_check((i + 1) % check_every == 0 ||
+				     i == trace->num_ops - 1)) {
+	    malloc_error(tracenum, i, "mm_check found an inconsistent heap.");
+	    return 0;
+	}
     }
 
     mem_reset();
 
+    if (verbose > 1 && reallocs > 0)
+	printf("(%d of %d reallocs resized in place) ", in_place, reallocs);
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
@@ -670,7 +1342,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   is always the high water mark of the heap. 
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio)
+static double eval_mm_util(trace_t *trace, int tracenum, void **ranges, double *inst_ratio)
 {   
     int i;
     int index;
@@ -681,6 +1353,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
     int ratio_exp;
     char *p;
     char *newp, *oldp;
+    mm_stats_t peak_stats, end_stats;
+    int peak_op = 0;
 
     /* initialize the heap and the mm malloc package */
     if (mm_init() < 0)
@@ -706,17 +1380,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 
             break;
 
-	case REALLOC: /* mm_mealloc + mm_free */
+	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_malloc(newsize)) == NULL)
+	    if ((newp = mm_realloc(oldp, newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
-            mm_free(oldp);
-
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = newsize;
@@ -752,8 +1424,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
                           : max_total_size);
 
         heap_size = mem_heapsize();
-        if (heap_size > max_heap_size)
+        if (heap_size > max_heap_size) {
           max_heap_size = heap_size;
+          if (dump_stats) {
+            mm_get_stats(&peak_stats);
+            peak_op = i;
+          }
+        }
 
         ratio = (double)(total_size + 1) / (heap_size + 1);
 
@@ -765,7 +1442,16 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
         accum_ratio_frac = frexp(accum_ratio_frac, &ratio_exp);
         accum_ratio_exp += ratio_exp;
         
-        // printf("%ld %ld %f\n", total_size, heap_size, ratio);
+        if (util_log)
+            fprintf(util_log, "%d %d %zu %zu %f\n",
+                    tracenum, i, total_size, heap_size, ratio);
+    }
+
+    if (dump_stats) {
+        mm_get_stats(&end_stats);
+        if (max_heap_size > 0)
+            print_mm_stats(tracenum, "at peak heap", peak_op, &peak_stats);
+        print_mm_stats(tracenum, "at end", trace->num_ops - 1, &end_stats);
     }
 
     mem_reset();
@@ -806,13 +1492,12 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
-	case REALLOC: /* mm_malloc + mm_free */
+	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_malloc(newsize)) == NULL)
+            if ((newp = mm_realloc(oldp, newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
-            mm_free(oldp);
             trace->blocks[index] = newp;
             break;
 
@@ -830,64 +1515,1427 @@ static void eval_mm_speed(void *ptr)
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * read_tsc - Read the cycle counter, or a nanosecond clock where
+ *     there is none. The lfence keeps rdtsc from being reordered
+ *     around the call being timed.
  */
-static int eval_libc_valid(trace_t *trace, int tracenum)
+static inline uint64_t read_tsc(void)
 {
-    int i, newsize;
-    char *p, *newp, *oldp;
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    asm volatile("lfence; rdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
 
-        case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
-		malloc_error(tracenum, i, "libc malloc failed");
-		unix_error("System message");
-	    }
-	    trace->blocks[trace->ops[i].index] = p;
-	    break;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
-	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
-	    if ((newp = realloc(oldp, newsize)) == NULL) {
-		malloc_error(tracenum, i, "libc realloc failed");
-		unix_error("System message");
-	    }
-	    trace->blocks[trace->ops[i].index] = newp;
-	    break;
-	    
-        case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
-	    break;
+/*
+ * lat_bucket - Map a latency to its histogram bucket. Values below
+ *     2^(LAT_SUB_BITS+1) get a bucket each; above that every power of
+ *     two is split into 2^LAT_SUB_BITS equal buckets.
+ */
+static int lat_bucket(uint64_t v)
+{
+    int k;
 
-	default:
-	    app_error("invalid operation type  in eval_libc_valid");
-	}
-    }
+    if (v < (2 << LAT_SUB_BITS))
+	return (int)v;
+    k = 63 - __builtin_clzll(v);
+    return ((k - LAT_SUB_BITS) << LAT_SUB_BITS) + (int)(v >> (k - LAT_SUB_BITS));
+}
 
-    return 1;
+/* lat_bucket_max - The largest latency that falls in bucket b */
+static uint64_t lat_bucket_max(int b)
+{
+    int k;
+    uint64_t lo;
+
+    if (b < (2 << LAT_SUB_BITS))
+	return b;
+    k = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    lo = (uint64_t)((1 << LAT_SUB_BITS) + (b & ((1 << LAT_SUB_BITS) - 1)))
+	<< (k - LAT_SUB_BITS);
+    return lo + ((uint64_t)1 << (k - LAT_SUB_BITS)) - 1;
 }
 
-/* 
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
- */
-static void eval_libc_speed(void *ptr)
+static void lat_record(lat_hist_t *h, uint64_t start, uint64_t end)
 {
-    int i;
-    int index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    uint64_t cycles = end - start;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
-        case ALLOC: /* malloc */
+    cycles = (cycles > tsc_overhead) ? cycles - tsc_overhead : 0;
+    h->count[lat_bucket(cycles)]++;
+    h->n++;
+    if (cycles > h->max)
+	h->max = cycles;
+}
+
+/*
+ * lat_percentile - Upper bound of the bucket holding the p-th fraction
+ *     of calls, which overstates the true value by at most 1/2^LAT_SUB_BITS
+ */
+static uint64_t lat_percentile(lat_hist_t *h, double p)
+{
+    uint64_t rank = (uint64_t)ceil(p * h->n), seen = 0;
+    int b;
+
+    if (rank == 0)
+	rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += h->count[b];
+	if (seen >= rank)
+	    return (lat_bucket_max(b) < h->max) ? lat_bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * lat_calibrate - Measure tsc_overhead once: the cheapest back-to-back
+ *     pair of counter reads
+ */
+static void lat_calibrate(void)
+{
+    uint64_t start, end;
+    int i;
+
+    if (tsc_overhead != 0)
+	return;
+    tsc_overhead = UINT64_MAX;
+    for (i = 0; i < 1000; i++) {
+	start = read_tsc();
+	end = read_tsc();
+	if (end - start < tsc_overhead)
+	    tsc_overhead = end - start;
+    }
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing each mm call on
+ *    its own. lat holds one histogram per request type.
+ */
+static void eval_mm_latency(trace_t *trace, lat_hist_t *lat)
+{
+    int i, index;
+    uint64_t start, end;
+    char *p;
+
+    lat_calibrate();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* mm_malloc */
+	    start = read_tsc();
+	    p = mm_malloc(trace->ops[i].size);
+	    end = read_tsc();
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    start = read_tsc();
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    end = read_tsc();
+	    if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    start = read_tsc();
+	    mm_free(trace->blocks[index]);
+	    end = read_tsc();
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+	lat_record(&lat[trace->ops[i].type], start, end);
+    }
+
+    mem_reset();
+}
+
+/*
+ * anon_huge_kb - AnonHugePages of this process in KB, or -1 if the
+ *    kernel does not report it
+ */
+static long anon_huge_kb(void)
+{
+    char line[MAXLINE];
+    long kb = -1;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/smaps_rollup", "r")) == NULL)
+	return -1;
+    while (fgets(line, MAXLINE, f) != NULL)
+	if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+	    break;
+    fclose(f);
+    return kb;
+}
+
+/*
+ * eval_tlb - Fill a heap of the given size with small mm_malloc blocks,
+ *    then update the blocks in random order, once with 4KB pages and
+ *    once with huge-page arenas. Both runs see the same sizes and order.
+ *    The dTLB miss column reads "n/a" where the CPU or VM does not
+ *    expose the counter; AnonHugePages shows whether huge pages were
+ *    actually used.
+ */
+static void eval_tlb(int megabytes)
+{
+    size_t target = (size_t)megabytes << 20, live, n, max_blocks, i, j;
+    char **blocks;
+    size_t *order, tmp;
+    int huge, pass, fd;
+    long long misses;
+    struct timespec start, end;
+    double secs;
+
+    max_blocks = target / TLB_MIN_BLOCK + 1;
+    blocks = (char **)malloc(max_blocks * sizeof(char *));
+    order = (size_t *)malloc(max_blocks * sizeof(size_t));
+    if (blocks == NULL || order == NULL)
+	unix_error("malloc failed in eval_tlb");
+    fd = perfctr_open(PERFCTR_DTLB_MISSES);
+
+    printf("%5s%10s%10s%14s%16s\n",
+	   "pages", "blocks", "secs", perfctr_name(PERFCTR_DTLB_MISSES),
+	   "AnonHugePages");
+    for (huge = 0; huge <= 1; huge++) {
+	mem_set_hugepages(huge);
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_tlb");
+
+	srand(1);
+	for (n = 0, live = 0; live < target && n < max_blocks; n++) {
+	    size_t size = TLB_MIN_BLOCK +
+		rand() % (TLB_MAX_BLOCK - TLB_MIN_BLOCK + 1);
+	    if ((blocks[n] = mm_malloc(size)) == NULL)
+		app_error("mm_malloc failed in eval_tlb");
+	    memset(blocks[n], 0, size);
+	    live += size;
+	}
+	for (i = 0; i < n; i++)
+	    order[i] = i;
+	for (i = n - 1; i > 0; i--) {
+	    j = rand() % (i + 1);
+	    tmp = order[i];
+	    order[i] = order[j];
+	    order[j] = tmp;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	perfctr_start(fd);
+	for (pass = 0; pass < TLB_PASSES; pass++)
+	    for (i = 0; i < n; i++)
+		(*(volatile long *)blocks[order[i]])++;
+	misses = perfctr_stop(fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (misses >= 0)
+	    printf("%5s%10lu%10.4f%14lld%13ld KB\n", huge ? "2MB" : "4KB",
+		   (unsigned long)n, secs, misses, anon_huge_kb());
+	else
+	    printf("%5s%10lu%10.4f%14s%13ld KB\n", huge ? "2MB" : "4KB",
+		   (unsigned long)n, secs, "n/a", anon_huge_kb());
+
+	mem_reset();
+    }
+    mem_set_hugepages(0);
+
+    perfctr_close(fd);
+    free(blocks);
+    free(order);
+}
+
+/*****************************************************************
+ * The following routines compare the allocators in backends[] (-B).
+ * Each backend replays each trace in its own child process, so every
+ * one starts from the same fresh address space and its peak resident
+ * set can be read off at the end. They all go through the same
+ * function pointers, so mm malloc runs a little slower here than in
+ * the main results.
+ ****************************************************************/
+
+/* mm_deferred_init - mm.c with deferred coalescing */
+static int mm_deferred_init(void)
+{
+    mm_set_deferred(1);
+    return mm_init();
+}
+
+/* libc_held - Bytes libc has taken from the system for its heap */
+static size_t libc_held(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.arena + mi.hblkhd;
+}
+
+/* libc_init - libc has no fresh heap; measure it from what it holds now */
+static int libc_init(void)
+{
+    libc_base = libc_held();
+    return 0;
+}
+
+static size_t libc_heapsize(void)
+{
+    size_t held = libc_held();
+
+    return held > libc_base ? held - libc_base : 0;
+}
+
+/*
+ * backend_release - Free every block a replay left live, or the whole
+ *     heap at once if the backend can drop it
+ */
+static void backend_release(backend_t *b, trace_t *trace)
+{
+    int i;
+
+    if (b->reset) {
+	b->reset();
+	return;
+    }
+    for (i = 0; i < trace->num_ids; i++)
+	if (trace->blocks[i] != NULL)
+	    b->free(trace->blocks[i]);
+}
+
+/*
+ * eval_backend_valid - Replay the trace once with payload patterns,
+ *     checking that every block is aligned, that realloc keeps the
+ *     data and that no payload is overwritten before it is freed
+ */
+static int eval_backend_valid(backend_t *b, trace_t *trace, int tracenum)
+{
+    int i, j, index, size, oldsize;
+    char *p;
+
+    if (b->init() < 0)
+	app_error("init failed in eval_backend_valid");
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* malloc */
+	case REALLOC: /* realloc */
+	    oldsize = 0;
+	    if (trace->ops[i].type == ALLOC)
+		p = b->malloc(size);
+	    else {
+		if ((j = check_payload(trace->blocks[index], index,
+				       trace->block_sizes[index])) >= 0) {
+		    sprintf(msg, "Payload was overwritten at offset %d "
+			    "before realloc", j);
+		    malloc_error(tracenum, i, msg);
+		    return 0;
+		}
+		oldsize = (size < trace->block_sizes[index]) ?
+		    size : trace->block_sizes[index];
+		p = b->realloc(trace->blocks[index], size);
+	    }
+	    if (p == NULL) {
+		malloc_error(tracenum, i, "backend malloc or realloc failed.");
+		return 0;
+	    }
+	    if (!IS_ALIGNED(p)) {
+		sprintf(msg, "Payload address (%p) not aligned to %d bytes",
+			p, ALIGNMENT);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	    if (check_payload(p, index, oldsize) >= 0) {
+		malloc_error(tracenum, i, "realloc did not preserve the "
+			     "data from old block");
+		return 0;
+	    }
+	    fill_payload(p, index, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+	case FREE: /* free */
+	    if ((j = check_payload(trace->blocks[index], index,
+				   trace->block_sizes[index])) >= 0) {
+		sprintf(msg, "Payload was overwritten at offset %d "
+			"before free", j);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	    b->free(trace->blocks[index]);
+	    trace->blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_backend_valid");
+	}
+    }
+    backend_release(b, trace);
+    return 1;
+}
+
+/*
+ * eval_backend_util - Space utilization of a backend on a trace, and
+ *     (in inst_ratio) the geometric mean of its utilization after each
+ *     request. The running product is kept as a mantissa and a power
+ *     of two so that it cannot underflow, and the n-th root is taken
+ *     of both.
+ */
+static double eval_backend_util(backend_t *b, trace_t *trace,
+				double *inst_ratio)
+{
+    int i, index, size;
+    size_t total_size = 0, max_total_size = 0, heap_size, max_heap_size = 0;
+    double ratio, ratio_frac, accum_ratio_frac = 1.0, accum_ratio_exp = 0.0;
+    int ratio_exp;
+    char *p;
+
+    if (b->init() < 0)
+	app_error("init failed in eval_backend_util");
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* malloc */
+	    if ((p = b->malloc(size)) == NULL)
+		app_error("malloc failed in eval_backend_util");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    break;
+
+	case REALLOC: /* realloc */
+	    if ((p = b->realloc(trace->blocks[index], size)) == NULL)
+		app_error("realloc failed in eval_backend_util");
+	    total_size += size - trace->block_sizes[index];
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+	case FREE: /* free */
+	    b->free(trace->blocks[index]);
+	    trace->blocks[index] = NULL;
+	    total_size -= trace->block_sizes[index];
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_backend_util");
+	}
+
+	if (total_size > max_total_size)
+	    max_total_size = total_size;
+	heap_size = b->heap_size();
+	if (heap_size > max_heap_size)
+	    max_heap_size = heap_size;
+
+	ratio = (double)(total_size + 1) / (heap_size + 1);
+	ratio_frac = frexp(ratio, &ratio_exp);
+	accum_ratio_frac *= ratio_frac;
+	accum_ratio_exp += ratio_exp;
+	accum_ratio_frac = frexp(accum_ratio_frac, &ratio_exp);
+	accum_ratio_exp += ratio_exp;
+    }
+    backend_release(b, trace);
+
+    *inst_ratio = exp((log(accum_ratio_frac) + accum_ratio_exp * log(2)) /
+		      trace->num_ops);
+    return max_heap_size ? (double)max_total_size / max_heap_size : 0;
+}
+
+/*
+ * eval_backend_speed - This is the function that is used by fcyc()
+ *    to measure the running time of a backend
+ */
+static void eval_backend_speed(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    backend_t *b = ((speed_t *)ptr)->backend;
+    int i, index;
+    char *p;
+
+    if (b->init() < 0)
+	app_error("init failed in eval_backend_speed");
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* malloc */
+	    if ((p = b->malloc(trace->ops[i].size)) == NULL)
+		app_error("malloc failed in eval_backend_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+	    if ((p = b->realloc(trace->blocks[index], trace->ops[i].size)) == NULL)
+		app_error("realloc failed in eval_backend_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* free */
+	    b->free(trace->blocks[index]);
+	    trace->blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_backend_speed");
+	}
+    }
+    backend_release(b, trace);
+}
+
+/*
+ * eval_backend_latency - Replay the trace once more, timing each call
+ *    on its own, all of them in one histogram
+ */
+static void eval_backend_latency(backend_t *b, trace_t *trace,
+				 lat_hist_t *lat)
+{
+    int i, index;
+    uint64_t start, end;
+    char *p;
+
+    lat_calibrate();
+    if (b->init() < 0)
+	app_error("init failed in eval_backend_latency");
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	switch (trace->ops[i].type) {
+
+	case ALLOC: /* malloc */
+	    start = read_tsc();
+	    p = b->malloc(trace->ops[i].size);
+	    end = read_tsc();
+	    if (p == NULL)
+		app_error("malloc failed in eval_backend_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+	    start = read_tsc();
+	    p = b->realloc(trace->blocks[index], trace->ops[i].size);
+	    end = read_tsc();
+	    if (p == NULL)
+		app_error("realloc failed in eval_backend_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case FREE: /* free */
+	    start = read_tsc();
+	    b->free(trace->blocks[index]);
+	    end = read_tsc();
+	    trace->blocks[index] = NULL;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_backend_latency");
+	}
+	lat_record(lat, start, end);
+    }
+    backend_release(b, trace);
+}
+
+/*
+ * status_kb - A "<name>: <n> kB" field of /proc/self/status, or 0
+ */
+static long status_kb(char *name)
+{
+    char line[MAXLINE];
+    size_t len = strlen(name);
+    long kb = 0;
+    FILE *f;
+
+    if ((f = fopen("/proc/self/status", "r")) == NULL)
+	return 0;
+    while (fgets(line, MAXLINE, f) != NULL)
+	if (strncmp(line, name, len) == 0 && line[len] == ':') {
+	    sscanf(line + len + 1, "%ld", &kb);
+	    break;
+	}
+    fclose(f);
+    return kb;
+}
+
+/*
+ * backend_thread - Measure utilization, throughput and latency for
+ *     eval_backend, then check the backend on the trace so that only
+ *     the numbers of a correct run are reported. The check comes last
+ *     because the memory libc keeps after it would count against the
+ *     utilization. On a thread of its own, libc malloc serves the
+ *     replays from a fresh arena instead of the free space the driver
+ *     has left in the main one, so its heap size counts only what the
+ *     trace made it take.
+ */
+static void *backend_thread(void *ptr)
+{
+    backend_run_t *run = (backend_run_t *)ptr;
+    backend_result_t *result = run->result;
+    trace_t *trace = run->params.trace;
+    backend_t *b = run->params.backend;
+
+    result->stats.util = eval_backend_util(b, trace, &result->stats.inst_util);
+    result->stats.secs = fsecs(eval_backend_speed, &run->params);
+    eval_backend_latency(b, trace, run->lat);
+    result->stats.valid = eval_backend_valid(b, trace, run->tracenum);
+    return NULL;
+}
+
+/*
+ * eval_backend - Measure one backend on one trace: utilization,
+ *     throughput, latency and how far the run pushed the peak resident
+ *     set above where the process started
+ */
+static void eval_backend(backend_t *b, trace_t *trace, int tracenum,
+			 backend_result_t *result)
+{
+    backend_run_t run;
+    pthread_t tid;
+    long resident;
+    int fd;
+
+    /* 
+     * Hand back the pages memlib keeps cached, so mm faults its own
+     * in, then restart the peak from here (clear_refs 5 resets VmHWM)
+     */
+    mem_flush_cache();
+    if ((fd = open("/proc/self/clear_refs", O_WRONLY)) >= 0) {
+	write(fd, "5", 1);
+	close(fd);
+    }
+    resident = status_kb("VmRSS");
+
+    memset(result, 0, sizeof(*result));
+    if ((run.lat = (lat_hist_t *)calloc(1, sizeof(lat_hist_t))) == NULL)
+	unix_error("calloc failed in eval_backend");
+    run.params.trace = trace;
+    run.params.ranges = NULL;
+    run.params.backend = b;
+    run.result = result;
+    run.tracenum = tracenum;
+    if (pthread_create(&tid, NULL, backend_thread, &run) != 0 ||
+	pthread_join(tid, NULL) != 0)
+	app_error("could not run the backend thread in eval_backend");
+
+    result->stats.ops = trace->num_ops;
+    result->p50 = lat_percentile(run.lat, 0.50);
+    result->p99 = lat_percentile(run.lat, 0.99);
+    result->max = run.lat->max;
+    result->rss_kb = status_kb("VmHWM") - resident;
+    free(run.lat);
+}
+
+/*
+ * eval_backends - Run every backend on every trace, one child process
+ *    at a time so that they do not compete for the CPU. results holds
+ *    NUM_BACKENDS entries per trace.
+ */
+static void eval_backends(char **tracefiles, int num_tracefiles,
+			  backend_result_t *results)
+{
+    trace_t *trace;
+    backend_result_t result, *r;
+    int i, j, k, fd[2], status;
+    size_t got;
+    ssize_t n;
+    pid_t pid;
+    volatile long sum = 0;
+
+    for (i = 0; i < num_tracefiles; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+
+	/* Fault the trace in now so that it counts against no backend */
+	memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+	memset(trace->block_sizes, 0, trace->num_ids * sizeof(size_t));
+	for (k = 0; k < trace->num_ops; k++)
+	    sum += trace->ops[k].size;
+
+	for (j = 0; j < NUM_BACKENDS; j++) {
+	    r = &results[i * NUM_BACKENDS + j];
+	    if (verbose > 1)
+		printf("Running %s on %s\n", backends[j].name, tracefiles[i]);
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_backends");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_backends");
+	    if (pid == 0) {
+		close(fd[0]);
+		eval_backend(&backends[j], trace, i, &result);
+		fflush(stdout);
+		for (got = 0; got < sizeof(result); got += n)
+		    if ((n = write(fd[1], (char *)&result + got,
+				   sizeof(result) - got)) <= 0)
+			_exit(1);
+		_exit(0);
+	    }
+	    close(fd[1]);
+	    for (got = 0; got < sizeof(result); got += n)
+		if ((n = read(fd[0], (char *)&result + got,
+			      sizeof(result) - got)) <= 0)
+		    break;
+	    close(fd[0]);
+	    if (waitpid(pid, &status, 0) < 0)
+		unix_error("waitpid failed in eval_backends");
+
+	    if (got != sizeof(result) || !WIFEXITED(status) ||
+		WEXITSTATUS(status) != 0) {
+		sprintf(msg, "backend %s failed (status 0x%x)",
+			backends[j].name, status);
+		malloc_error(i, 0, msg);
+		memset(r, 0, sizeof(*r));
+		continue;
+	    }
+	    if (!result.stats.valid)
+		errors++; /* the worker has said why */
+	    *r = result;
+	}
+	free_trace(trace);
+    }
+}
+
+/*****************************************************************
+ * The following routines fuzz the mm package (-z). Each random trace
+ * runs in a child process with payload patterns and deep heap checks,
+ * so that a crash or a hang fails the trace instead of the driver.
+ * The first failing trace is shrunk with delta debugging and written
+ * out as a .rep file that reproduces the failure.
+ ****************************************************************/
+
+/* fuzz_rand - splitmix64, so that a seed gives the same trace anywhere */
+static uint64_t fuzz_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* fuzz_size - Mostly small requests, some medium and a few large ones */
+static int fuzz_size(uint64_t *state)
+{
+    int pick = fuzz_rand(state) % 10;
+    int max = pick < 6 ? 64 : pick < 9 ? 4096 : FUZZ_LARGE;
+
+    return 1 + fuzz_rand(state) % max;
+}
+
+/*
+ * fuzz_trace - Fill ops with the FUZZ_OPS requests of the random trace
+ *     for seed and return its number of ids. Ids are never reused, so
+ *     dropping a block's allocation together with its later requests
+ *     always leaves a well-formed trace.
+ */
+static int fuzz_trace(uint64_t seed, traceop_t *ops)
+{
+    uint64_t state = seed;
+    int *live, num_live = 0, num_ids = 0, i, k, pick;
+
+    if ((live = (int *)malloc(FUZZ_OPS * sizeof(int))) == NULL)
+	unix_error("malloc failed in fuzz_trace");
+    for (i = 0; i < FUZZ_OPS; i++) {
+	pick = fuzz_rand(&state) % 10;
+	if (num_live == 0 || pick < 5) {
+	    ops[i].type = ALLOC;
+	    ops[i].index = num_ids;
+	    ops[i].size = fuzz_size(&state);
+	    live[num_live++] = num_ids++;
+	    continue;
+	}
+	k = fuzz_rand(&state) % num_live;
+	ops[i].index = live[k];
+	if (pick < 8) {
+	    ops[i].type = FREE;
+	    ops[i].size = 0;
+	    live[k] = live[--num_live];
+	}
+	else {
+	    ops[i].type = REALLOC;
+	    ops[i].size = fuzz_size(&state);
+	}
+    }
+    free(live);
+    return num_ids;
+}
+
+/*
+ * fuzz_select - Copy the requests marked in keep into out, dropping
+ *     those of blocks whose allocation was dropped and numbering the
+ *     remaining blocks from 0. Returns the number of requests copied.
+ */
+static int fuzz_select(traceop_t *ops, int num_ops, char *keep,
+		       traceop_t *out, int *num_ids)
+{
+    int *ids, i, n = 0, max_id = 0;
+
+    for (i = 0; i < num_ops; i++)
+	if (ops[i].index >= max_id)
+	    max_id = ops[i].index + 1;
+    if ((ids = (int *)malloc((max_id + 1) * sizeof(int))) == NULL)
+	unix_error("malloc failed in fuzz_select");
+    for (i = 0; i < max_id; i++)
+	ids[i] = -1;
+
+    *num_ids = 0;
+    for (i = 0; i < num_ops; i++) {
+	if (!keep[i])
+	    continue;
+	if (ops[i].type == ALLOC)
+	    ids[ops[i].index] = (*num_ids)++;
+	if (ids[ops[i].index] < 0)
+	    continue;
+	out[n] = ops[i];
+	out[n].index = ids[ops[i].index];
+	n++;
+    }
+    free(ids);
+    return n;
+}
+
+/*
+ * fuzz_run - Replay a trace in a child process with payload patterns and
+ *     heap checks, its output discarded if quiet. Returns 1 if it passed.
+ */
+static int fuzz_run(traceop_t *ops, int num_ops, int num_ids, int quiet)
+{
+    trace_t trace;
+    void *ranges = NULL;
+    pid_t pid;
+    int status, fd;
+
+    memset(&trace, 0, sizeof(trace));
+    trace.num_ids = num_ids;
+    trace.num_ops = num_ops;
+    trace.ops = ops;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+	unix_error("fork failed in fuzz_run");
+    if (pid == 0) {
+	if (quiet && (fd = open("/dev/null", O_WRONLY)) >= 0) {
+	    dup2(fd, STDOUT_FILENO);
+	    dup2(fd, STDERR_FILENO);
+	}
+	trace.blocks = (char **)malloc((num_ids + 1) * sizeof(char *));
+	trace.block_sizes = (size_t *)malloc((num_ids + 1) * sizeof(size_t));
+	if (trace.blocks == NULL || trace.block_sizes == NULL)
+	    unix_error("malloc failed in fuzz_run");
+	pattern_check = 1;
+	if (!check_every)
+	    check_every = 1;
+	alarm(FUZZ_TIMEOUT);
+	status = eval_mm_valid(&trace, 0, &ranges);
+	fflush(stdout);
+	_exit(status ? 0 : 1);
+    }
+
+    if (waitpid(pid, &status, 0) < 0)
+	unix_error("waitpid failed in fuzz_run");
+    if (WIFEXITED(status))
+	return WEXITSTATUS(status) == 0;
+    if (!quiet)
+	printf("ERROR: mm malloc %s (signal %d)\n",
+	       WTERMSIG(status) == SIGALRM ? "hung" : "crashed",
+	       WTERMSIG(status));
+    return 0;
+}
+
+/*
+ * fuzz_shrink - Delta debugging: starting from the requests marked in
+ *     keep, which fail, repeatedly try dropping one of n chunks of them,
+ *     keep any smaller trace that still fails, and refine the chunks
+ *     until no single request can be dropped. Returns the number of
+ *     requests left; runs counts the replays.
+ */
+static int fuzz_shrink(traceop_t *ops, int num_ops, char *keep, int *runs)
+{
+    traceop_t *out;
+    char *trial;
+    int *kept, num_kept, n = 2, chunk, start, i, m, num_ids, reduced;
+
+    out = (traceop_t *)malloc(num_ops * sizeof(traceop_t));
+    trial = (char *)malloc(num_ops);
+    kept = (int *)malloc(num_ops * sizeof(int));
+    if (out == NULL || trial == NULL || kept == NULL)
+	unix_error("malloc failed in fuzz_shrink");
+
+    for (;;) {
+	for (i = 0, num_kept = 0; i < num_ops; i++)
+	    if (keep[i])
+		kept[num_kept++] = i;
+	if (num_kept < 2)
+	    break;
+	if (n > num_kept)
+	    n = num_kept;
+
+	chunk = (num_kept + n - 1) / n;
+	reduced = 0;
+	for (start = 0; start < num_kept && !reduced; start += chunk) {
+	    memcpy(trial, keep, num_ops);
+	    for (i = start; i < start + chunk && i < num_kept; i++)
+		trial[kept[i]] = 0;
+	    m = fuzz_select(ops, num_ops, trial, out, &num_ids);
+	    (*runs)++;
+	    if (m > 0 && !fuzz_run(out, m, num_ids, 1)) {
+		memcpy(keep, trial, num_ops);
+		n = n > 2 ? n - 1 : 2;
+		reduced = 1;
+	    }
+	}
+	if (!reduced) {
+	    if (n == num_kept)
+		break;
+	    n = 2 * n < num_kept ? 2 * n : num_kept;
+	}
+    }
+
+    free(out);
+    free(trial);
+    free(kept);
+    return num_kept;
+}
+
+/*
+ * write_rep_trace - Write a trace in the text .rep format, with the
+ *     peak number of live payload bytes as its suggested heap size
+ */
+static void write_rep_trace(char *path, traceop_t *ops, int num_ops,
+			    int num_ids)
+{
+    FILE *fp;
+    size_t *sizes, live = 0, peak = 0;
+    int i;
+
+    if ((sizes = (size_t *)calloc(num_ids + 1, sizeof(size_t))) == NULL)
+	unix_error("calloc failed in write_rep_trace");
+    for (i = 0; i < num_ops; i++) {
+	live += (ops[i].type == FREE ? 0 : ops[i].size) - sizes[ops[i].index];
+	sizes[ops[i].index] = ops[i].type == FREE ? 0 : ops[i].size;
+	if (live > peak)
+	    peak = live;
+    }
+    free(sizes);
+
+    if ((fp = fopen(path, "w")) == NULL) {
+	sprintf(msg, "Could not open %s in write_rep_trace", path);
+	unix_error(msg);
+    }
+    fprintf(fp, "%lu\n%d\n%d\n1\n", (unsigned long)peak, num_ids, num_ops);
+    for (i = 0; i < num_ops; i++) {
+	if (ops[i].type == FREE)
+	    fprintf(fp, "f %d\n", ops[i].index);
+	else
+	    fprintf(fp, "%c %d %d\n", ops[i].type == ALLOC ? 'a' : 'r',
+		    ops[i].index, ops[i].size);
+    }
+    if (fclose(fp) != 0)
+	unix_error("fclose failed in write_rep_trace");
+}
+
+/*
+ * fuzz_mm - Run the random traces for seed, seed+1, ... until one fails
+ *     or rounds of them (if rounds > 0) have passed. A failing trace is
+ *     shrunk, saved as fuzz-<seed>.rep and replayed once more to show
+ *     its errors. Returns the exit status for the driver.
+ */
+static int fuzz_mm(uint64_t seed, long rounds)
+{
+    traceop_t *ops, *out;
+    char *keep, path[MAXLINE];
+    long round;
+    int num_ids, n, runs = 0;
+
+    ops = (traceop_t *)malloc(FUZZ_OPS * sizeof(traceop_t));
+    out = (traceop_t *)malloc(FUZZ_OPS * sizeof(traceop_t));
+    keep = (char *)malloc(FUZZ_OPS);
+    if (ops == NULL || out == NULL || keep == NULL)
+	unix_error("malloc failed in fuzz_mm");
+
+    printf("Fuzzing mm malloc with %d-request traces from seed %llu\n",
+	   FUZZ_OPS, (unsigned long long)seed);
+    for (round = 0; rounds == 0 || round < rounds; round++, seed++) {
+	num_ids = fuzz_trace(seed, ops);
+	if (fuzz_run(ops, FUZZ_OPS, num_ids, 0)) {
+	    if (verbose && (round + 1) % 100 == 0)
+		printf("%ld traces passed\n", round + 1);
+	    continue;
+	}
+
+	printf("Trace for seed %llu failed; shrinking it\n",
+	       (unsigned long long)seed);
+	memset(keep, 1, FUZZ_OPS);
+	fuzz_shrink(ops, FUZZ_OPS, keep, &runs);
+	n = fuzz_select(ops, FUZZ_OPS, keep, out, &num_ids);
+	sprintf(path, "fuzz-%llu.rep", (unsigned long long)seed);
+	write_rep_trace(path, out, n, num_ids);
+	printf("Shrunk to %d requests in %d runs and saved as %s:\n",
+	       n, runs, path);
+	fuzz_run(out, n, num_ids, 0);
+	return 1;
+    }
+
+    printf("All %ld traces passed\n", rounds);
+    free(ops);
+    free(out);
+    free(keep);
+    return 0;
+}
+
+/*
+ * eval_mm_trace - Evaluate the mm malloc package on one trace: validity,
+ *    utilization and, if it is valid, speed, hardware events (-P) and
+ *    (lat != NULL) latency
+ */
+static void eval_mm_trace(char *tracefile, int tracenum, stats_t *stats,
+			  lat_hist_t *lat)
+{
+    trace_t *trace;
+    static void *ranges = NULL;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, tracefile);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, &ranges, &stats->inst_util);
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+	if (counters) {
+	    perfctr_start_set(counters);
+	    eval_mm_speed(&speed_params);
+	    perfctr_stop_set(counters, stats->events);
+	}
+	if (lat)
+	    eval_mm_latency(trace, lat);
+    }
+    free_trace(trace);
+}
+
+/*
+ * run_mm_jobs - Evaluate the traces in forked worker processes, at most
+ *    jobs at a time, collecting each worker's results over a pipe. Every
+ *    worker starts from the parent's fresh allocator state, so traces
+ *    stay isolated; a worker that crashes only invalidates its trace.
+ *    Workers compete for the CPU, so time them on an otherwise idle
+ *    machine with jobs no larger than the core count.
+ */
+static void run_mm_jobs(char **tracefiles, int num_tracefiles, int jobs,
+			stats_t *stats, lat_hist_t *lat, pagemap_usage *pm)
+{
+    pid_t *pids;
+    int *fds;
+    struct pollfd *pfds;
+    int next = 0, running = 0, i, j, status, fd[2];
+    job_result_t result;
+    size_t got;
+    ssize_t n;
+    pid_t pid;
+
+    pids = (pid_t *)calloc(num_tracefiles, sizeof(pid_t));
+    fds = (int *)calloc(num_tracefiles, sizeof(int));
+    pfds = (struct pollfd *)calloc(jobs, sizeof(struct pollfd));
+    if (pids == NULL || fds == NULL || pfds == NULL)
+	unix_error("calloc failed in run_mm_jobs");
+    memset(pm, 0, sizeof(*pm));
+
+    while (next < num_tracefiles || running > 0) {
+	/* Start workers until jobs are running */
+	while (next < num_tracefiles && running < jobs) {
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in run_mm_jobs");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in run_mm_jobs");
+	    if (pid == 0) {
+		close(fd[0]);
+		/* The parent's counters would count the parent */
+		if (counters) {
+		    perfctr_close_set(counters);
+		    perfctr_open_set(counters);
+		}
+		memset(&result, 0, sizeof(result));
+		/* Report only this trace's errors, not the inherited count */
+		errors = 0;
+		eval_mm_trace(tracefiles[next], next, &result.stats,
+			      lat ? result.lat : NULL);
+		result.errors = errors;
+		pagemap_get_usage(&result.pm_usage);
+		fflush(stdout);
+		for (got = 0; got < sizeof(result); got += n)
+		    if ((n = write(fd[1], (char *)&result + got,
+				   sizeof(result) - got)) <= 0)
+			_exit(1);
+		_exit(0);
+	    }
+	    close(fd[1]);
+	    pids[next] = pid;
+	    fds[next] = fd[0];
+	    next++;
+	    running++;
+	}
+
+	/*
+	 * Collect whichever worker has its result ready first. Its pipe is
+	 * drained before waiting for it, since a result larger than the
+	 * pipe buffer would leave the worker blocked in write.
+	 */
+	for (i = 0, j = 0; i < next; i++)
+	    if (fds[i] >= 0) {
+		pfds[j].fd = fds[i];
+		pfds[j].events = POLLIN;
+		j++;
+	    }
+	if (poll(pfds, j, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("poll failed in run_mm_jobs");
+	}
+	for (j = 0; pfds[j].revents == 0; j++)
+	    ;
+	for (i = 0; fds[i] != pfds[j].fd; i++)
+	    ;
+
+	for (got = 0; got < sizeof(result); got += n)
+	    if ((n = read(fds[i], (char *)&result + got,
+			  sizeof(result) - got)) <= 0)
+		break;
+	close(fds[i]);
+	fds[i] = -1;
+	if (waitpid(pids[i], &status, 0) < 0)
+	    unix_error("waitpid failed in run_mm_jobs");
+	running--;
+
+	if (got != sizeof(result) || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+	    sprintf(msg, "worker process failed (status 0x%x)", status);
+	    malloc_error(i, 0, msg);
+	    memset(&stats[i], 0, sizeof(stats_t));
+	    continue;
+	}
+	stats[i] = result.stats;
+	errors += result.errors;
+	if (lat)
+	    memcpy(&lat[i * LAT_OP_TYPES], result.lat, sizeof(result.lat));
+	if (result.pm_usage.peak_mapped > pm->peak_mapped)
+	    *pm = result.pm_usage;
+    }
+
+    free(pids);
+    free(fds);
+    free(pfds);
+}
+
+/*
+ * eval_mm_threads - Replay one trace from num_threads threads at once,
+ *    each with its own block array, against the shared mm heap. With
+ *    arenas set, thread t uses the arena of CPU t. Also used by fsecs()
+ *    to time the threaded mode.
+ */
+static void eval_mm_threads(void *ptr)
+{
+    threads_t *params = (threads_t *)ptr;
+    trace_t *trace = params->trace;
+    int n = params->num_threads;
+    pthread_t *tids;
+    replay_t *replays;
+    pthread_barrier_t start;
+    int t;
+
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_threads");
+
+    tids = (pthread_t *)malloc(n * sizeof(pthread_t));
+    replays = (replay_t *)calloc(n, sizeof(replay_t));
+    if (tids == NULL || replays == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+    pthread_barrier_init(&start, NULL, n);
+
+    for (t = 0; t < n; t++) {
+	replays[t].trace = trace;
+	replays[t].thread = t;
+	replays[t].check = params->check;
+	replays[t].cpu = params->arenas ? t : -1;
+	replays[t].start = &start;
+	replays[t].blocks = (char **)malloc(trace->num_ids * sizeof(char *));
+	replays[t].block_sizes = (size_t *)malloc(trace->num_ids * sizeof(size_t));
+	if (replays[t].blocks == NULL || replays[t].block_sizes == NULL)
+	    unix_error("malloc failed in eval_mm_threads");
+	if (pthread_create(&tids[t], NULL, replay_trace, &replays[t]) != 0)
+	    app_error("pthread_create failed in eval_mm_threads");
+    }
+
+    for (t = 0; t < n; t++) {
+	pthread_join(tids[t], NULL);
+	params->errors += replays[t].errors;
+	free(replays[t].blocks);
+	free(replays[t].block_sizes);
+    }
+
+    pthread_barrier_destroy(&start);
+    free(replays);
+    free(tids);
+
+    mem_reset();
+}
+
+/*
+ * replay_trace - Thread body for eval_mm_threads. With check set, every
+ *    payload is filled with a byte made of its index and the thread's
+ *    number, and verified in full before it is resized or freed, which
+ *    catches blocks handed to two threads at once.
+ */
+static void *replay_trace(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    int i, index, size;
+    size_t keep;
+    char *p, *oldp;
+
+    if (r->cpu >= 0)
+	mm_bind_arena(r->cpu);
+    pthread_barrier_wait(r->start);
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc failed in replay_trace");
+	    if (r->check) {
+		if (!IS_ALIGNED(p))
+		    r->errors++;
+		memset(p, REPLAY_FILL(r->thread, index), size);
+	    }
+	    r->blocks[index] = p;
+	    r->block_sizes[index] = size;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    oldp = r->blocks[index];
+	    if ((p = mm_realloc(oldp, size)) == NULL)
+		app_error("mm_realloc failed in replay_trace");
+	    if (r->check) {
+		keep = (r->block_sizes[index] < (size_t)size) ?
+		    r->block_sizes[index] : (size_t)size;
+		if (!IS_ALIGNED(p) ||
+		    !replay_filled(p, REPLAY_FILL(r->thread, index), keep))
+		    r->errors++;
+		memset(p, REPLAY_FILL(r->thread, index), size);
+	    }
+	    r->blocks[index] = p;
+	    r->block_sizes[index] = size;
+	    break;
+
+        case FREE: /* mm_free */
+	    p = r->blocks[index];
+	    if (r->check &&
+		!replay_filled(p, REPLAY_FILL(r->thread, index),
+			       r->block_sizes[index]))
+		r->errors++;
+	    mm_free(p);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_trace");
+        }
+    }
+
+    return NULL;
+}
+
+/* replay_filled - Does every one of p's size bytes still hold fill? */
+static int replay_filled(char *p, char fill, size_t size)
+{
+    size_t j;
+
+    for (j = 0; j < size; j++)
+	if (p[j] != fill)
+	    return 0;
+    return 1;
+}
+
+/*
+ * eval_prodcons - Run a producer and a consumer thread until all of
+ *    num_blocks blocks have passed between them. With arenas set, each
+ *    thread has an arena of its own, so the consumer's frees go back to
+ *    the producer's arena without a lock. Also used by fsecs() to time
+ *    the benchmark.
+ */
+static void eval_prodcons(void *ptr)
+{
+    prodcons_t *pc = (prodcons_t *)ptr;
+    pthread_t producer, consumer;
+
+    if (!pc->libc && mm_init() < 0)
+	app_error("mm_init failed in eval_prodcons");
+    pc->head = pc->tail = 0;
+
+    if (pthread_create(&producer, NULL, produce, pc) != 0 ||
+	pthread_create(&consumer, NULL, consume, pc) != 0)
+	app_error("pthread_create failed in eval_prodcons");
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    if (!pc->libc) {
+	if (pc->check && !mm_check(1))
+	    pc->errors++;
+	mem_reset();
+    }
+}
+
+/*
+ * produce - Producer thread body for eval_prodcons. Marks the first and
+ *    last byte of each block with its number, and yields whenever the
+ *    ring is full.
+ */
+static void *produce(void *ptr)
+{
+    prodcons_t *pc = (prodcons_t *)ptr;
+    unsigned long i;
+    int size;
+    char *p;
+
+    if (pc->arenas)
+	mm_bind_arena(0);
+
+    for (i = 0; i < (unsigned long)pc->num_blocks; i++) {
+	size = PC_SIZE(i);
+	if ((p = pc->libc ? malloc(size) : mm_malloc(size)) == NULL)
+	    app_error("malloc failed in produce");
+	p[0] = p[size - 1] = (char)(i & 0xFF);
+
+	while (i - __atomic_load_n(&pc->tail, __ATOMIC_ACQUIRE) == PC_RING)
+	    sched_yield();
+	pc->ring[i % PC_RING] = p;
+	__atomic_store_n(&pc->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consume - Consumer thread body for eval_prodcons. Checks and frees
+ *    the blocks in the order they were made, yielding whenever the ring
+ *    is empty.
+ */
+static void *consume(void *ptr)
+{
+    prodcons_t *pc = (prodcons_t *)ptr;
+    unsigned long i;
+    int size;
+    char *p;
+
+    if (pc->arenas)
+	mm_bind_arena(1);
+
+    for (i = 0; i < (unsigned long)pc->num_blocks; i++) {
+	while (__atomic_load_n(&pc->head, __ATOMIC_ACQUIRE) == i)
+	    sched_yield();
+	p = pc->ring[i % PC_RING];
+	__atomic_store_n(&pc->tail, i + 1, __ATOMIC_RELEASE);
+
+	size = PC_SIZE(i);
+	if (p[0] != (char)(i & 0xFF) || p[size - 1] != (char)(i & 0xFF))
+	    pc->errors++;
+	if (pc->libc)
+	    free(p);
+	else
+	    mm_free(p);
+    }
+    return NULL;
+}
+
+/*
+ * eval_libc_valid - We run this function to make sure that the
+ *    libc malloc can run to completion on the set of traces.
+ *    We'll be conservative and terminate if any libc malloc call fails.
+ *
+ */
+static int eval_libc_valid(trace_t *trace, int tracenum)
+{
+    int i, newsize;
+    char *p, *newp, *oldp;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[trace->ops[i].index];
+	    if ((newp = realloc(oldp, newsize)) == NULL) {
+		malloc_error(tracenum, i, "libc realloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = newp;
+	    break;
+	    
+        case FREE: /* free */
+	    free(trace->blocks[trace->ops[i].index]);
+	    break;
+
+	default:
+	    app_error("invalid operation type  in eval_libc_valid");
+	}
+    }
+
+    return 1;
+}
+
+/* 
+ * eval_libc_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the libc malloc package on the set
+ *    of traces.
+ */
+static void eval_libc_speed(void *ptr)
+{
+    int i;
+    int index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+        case ALLOC: /* malloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 	    if ((p = malloc(size)) == NULL)
@@ -899,9 +2947,8 @@ static void eval_libc_speed(void *ptr)
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-	    if ((newp = malloc(newsize)) == NULL)
-		unix_error("malloc failed in eval_libc_speed\n");
-            free(oldp);
+	    if ((newp = realloc(oldp, newsize)) == NULL)
+		unix_error("realloc failed in eval_libc_speed\n");
 	    
 	    trace->blocks[index] = newp;
 	    break;
@@ -982,6 +3029,249 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printevents - hardware event counts of each trace's extra replay,
+ *     divided by the number of requests; n/a where the event cannot
+ *     be counted here
+ */
+static void printevents(int n, stats_t *stats)
+{
+    int i, event;
+
+    printf("%5s", "trace");
+    for (event = 0; event < PERFCTR_NUM_EVENTS; event++)
+	printf("%11s", perfctr_name(event));
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	printf("%2d   ", i);
+	for (event = 0; event < PERFCTR_NUM_EVENTS; event++) {
+	    if (stats[i].valid && stats[i].events[event] >= 0)
+		printf("%11.2f", stats[i].events[event] / stats[i].ops);
+	    else
+		printf("%11s", "n/a");
+	}
+	printf("\n");
+    }
+}
+
+/*
+ * printlatency - per-trace and overall latency percentiles for each
+ *     request type; lat holds LAT_OP_TYPES histograms per trace
+ */
+static void printlatency(int n, lat_hist_t *lat)
+{
+    static char *names[LAT_OP_TYPES] = {"malloc", "free", "realloc"};
+    lat_hist_t total;
+    lat_hist_t *h;
+    int i, t, b;
+
+    printf("%5s%9s%9s%8s%8s%8s%10s\n",
+	   "trace", "op", "calls", "p50", "p99", "p99.9", "max");
+    for (t = 0; t < LAT_OP_TYPES; t++) {
+	memset(&total, 0, sizeof(total));
+	for (i=0; i < n; i++) {
+	    h = &lat[i * LAT_OP_TYPES + t];
+	    for (b = 0; b < LAT_BUCKETS; b++)
+		total.count[b] += h->count[b];
+	    total.n += h->n;
+	    if (h->max > total.max)
+		total.max = h->max;
+	    if (h->n == 0 || n == 1)
+		continue;
+	    printf("%2d%12s%9" PRIu64 "%8" PRIu64 "%8" PRIu64 "%8" PRIu64 "%10" PRIu64 "\n",
+		   i, names[t], h->n, lat_percentile(h, 0.5),
+		   lat_percentile(h, 0.99), lat_percentile(h, 0.999), h->max);
+	}
+	if (total.n == 0)
+	    continue;
+	printf("%-5s%9s%9" PRIu64 "%8" PRIu64 "%8" PRIu64 "%8" PRIu64 "%10" PRIu64 "\n",
+	       "Total", names[t], total.n, lat_percentile(&total, 0.5),
+	       lat_percentile(&total, 0.99), lat_percentile(&total, 0.999),
+	       total.max);
+    }
+}
+
+/*
+ * print_mm_stats - dump an mm_get_stats snapshot taken after op opnum
+ */
+static void print_mm_stats(int tracenum, char *when, int opnum, mm_stats_t *st)
+{
+    int cls;
+
+    printf("mm stats for trace %d %s (line %d):\n", tracenum, when,
+	   LINENUM(opnum));
+    printf("  heap %zu bytes: %d chunks (%d empty) %zu, %d slab pages %zu,"
+	   " %d large runs %zu\n", st->heap_bytes, st->chunks,
+	   st->empty_chunks, st->chunk_bytes, st->slab_pages, st->slab_bytes,
+	   st->large_runs, st->large_bytes);
+    printf("  in use %zu (%zu awaiting coalescing), free %zu, largest free"
+	   " block %zu\n", st->in_use_bytes, st->quick_bytes, st->free_bytes,
+	   st->largest_free);
+    printf("  mem_map %lu calls %zu bytes, mem_unmap %lu calls %zu bytes\n",
+	   st->map_calls, st->mapped_bytes, st->unmap_calls,
+	   st->unmapped_bytes);
+    for (cls = 0; cls < MM_STATS_CLASSES; cls++) {
+	if (st->class_free_blocks[cls] == 0)
+	    continue;
+	if (st->class_limit[cls] == SIZE_MAX)
+	    printf("  free class %2d (larger):   %6zu blocks %10zu bytes\n",
+		   cls, st->class_free_blocks[cls], st->class_free_bytes[cls]);
+	else
+	    printf("  free class %2d (<= %6zu): %6zu blocks %10zu bytes\n",
+		   cls, st->class_limit[cls], st->class_free_blocks[cls],
+		   st->class_free_bytes[cls]);
+    }
+}
+
+/*
+ * printdeferredresults - compare utilization and throughput with
+ *    immediate (now_stats) and deferred (later_stats) coalescing
+ */
+static void printdeferredresults(int n, stats_t *now_stats,
+                                 stats_t *later_stats)
+{
+    int i;
+    double now_kops, later_kops;
+    double now_secs = 0, later_secs = 0, ops = 0;
+    double now_util = 0, later_util = 0, now_inst = 0, later_inst = 0;
+
+    printf("%5s%7s%13s%15s%11s%11s%9s\n", "trace", " valid", "util now/def",
+	   "util_i now/def", "now Kops", "def Kops", "speedup");
+    for (i=0; i < n; i++) {
+	if (now_stats[i].valid && later_stats[i].valid) {
+	    now_kops = (now_stats[i].ops/1e3)/now_stats[i].secs;
+	    later_kops = (later_stats[i].ops/1e3)/later_stats[i].secs;
+	    printf("%2d%10s%7.0f%%%4.0f%%%9.0f%%%4.0f%%%11.0f%11.0f%8.2fx\n",
+		   i, "yes", now_stats[i].util*100.0, later_stats[i].util*100.0,
+		   now_stats[i].inst_util*100.0,
+		   later_stats[i].inst_util*100.0,
+		   now_kops, later_kops, later_kops/now_kops);
+	    now_secs += now_stats[i].secs;
+	    later_secs += later_stats[i].secs;
+	    ops += now_stats[i].ops;
+	    now_util += now_stats[i].util;
+	    later_util += later_stats[i].util;
+	    now_inst += now_stats[i].inst_util;
+	    later_inst += later_stats[i].inst_util;
+	}
+	else {
+	    printf("%2d%10s%13s%15s%11s%11s%9s\n", i, "no", "-", "-", "-",
+		   "-", "-");
+	}
+    }
+    if (ops > 0) {
+	printf("%-12s%7.0f%%%4.0f%%%9.0f%%%4.0f%%%11.0f%11.0f%8.2fx\n",
+	       "Total", now_util/n*100.0, later_util/n*100.0,
+	       now_inst/n*100.0, later_inst/n*100.0, (ops/1e3)/now_secs,
+	       (ops/1e3)/later_secs, now_secs/later_secs);
+    }
+}
+
+/*
+ * printbackendresults - every backend on each trace side by side, then
+ *    its totals; also one CSV row per backend and trace if csv is set
+ */
+static void printbackendresults(int n, char **tracefiles,
+				backend_result_t *results, FILE *csv)
+{
+    backend_result_t *r;
+    double secs, ops, util, inst_util;
+    int i, j, valid;
+
+    if (csv)
+	fprintf(csv, "trace,backend,valid,util,inst_util,ops,secs,kops,"
+		"p50_cycles,p99_cycles,max_cycles,peak_rss_kb\n");
+
+    printf("%5s %-12s%6s%7s%8s%7s%8s%10s%9s\n", "trace", "backend",
+	   "util", "util_i", "Kops", "p50", "p99", "max", "peakRSS");
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < NUM_BACKENDS; j++) {
+	    r = &results[i * NUM_BACKENDS + j];
+	    if (r->stats.valid)
+		printf("%5d %-12s%5.0f%%%6.0f%%%8.0f%7llu%8llu%10llu%9ld\n",
+		       i, backends[j].name, r->stats.util*100.0,
+		       r->stats.inst_util*100.0,
+		       (r->stats.ops/1e3)/r->stats.secs,
+		       (unsigned long long)r->p50, (unsigned long long)r->p99,
+		       (unsigned long long)r->max, r->rss_kb);
+	    else
+		printf("%5d %-12s%6s%7s%8s%7s%8s%10s%9s\n", i,
+		       backends[j].name, "-", "-", "-", "-", "-", "-", "-");
+	    if (csv)
+		fprintf(csv, "%s,%s,%d,%f,%f,%.0f,%f,%f,%llu,%llu,%llu,%ld\n",
+			tracefiles[i], backends[j].name, r->stats.valid,
+			r->stats.util, r->stats.inst_util, r->stats.ops,
+			r->stats.secs, r->stats.valid ?
+			(r->stats.ops/1e3)/r->stats.secs : 0.0,
+			(unsigned long long)r->p50, (unsigned long long)r->p99,
+			(unsigned long long)r->max, r->rss_kb);
+	}
+    }
+
+    /* Totals over the traces each backend ran correctly */
+    for (j = 0; j < NUM_BACKENDS; j++) {
+	secs = ops = util = inst_util = 0;
+	valid = 0;
+	for (i = 0; i < n; i++) {
+	    r = &results[i * NUM_BACKENDS + j];
+	    if (!r->stats.valid)
+		continue;
+	    secs += r->stats.secs;
+	    ops += r->stats.ops;
+	    util += r->stats.util;
+	    inst_util += r->stats.inst_util;
+	    valid++;
+	}
+	if (valid > 0)
+	    printf("%-5s %-12s%5.0f%%%6.0f%%%8.0f\n", "Total", backends[j].name,
+		   util/valid*100.0, inst_util/valid*100.0, (ops/1e3)/secs);
+    }
+}
+
+/*
+ * printthreadresults - compare threaded throughput with one thread and
+ *    with num_threads threads for each trace
+ */
+static void printthreadresults(int n, int num_threads, stats_t *one_stats,
+                               stats_t *many_stats)
+{
+    int i;
+    double one_kops, many_kops;
+
+    printf("%5s%7s%10s%10s%9s\n", "trace", " valid", "1 Kops", "N Kops", "speedup");
+    for (i=0; i < n; i++) {
+	if (many_stats[i].valid) {
+	    one_kops = (one_stats[i].ops/1e3)/one_stats[i].secs;
+	    many_kops = (many_stats[i].ops/1e3)/many_stats[i].secs;
+	    printf("%2d%10s%10.0f%10.0f%8.2fx\n",
+		   i, "yes", one_kops, many_kops, many_kops/one_kops);
+	}
+	else {
+	    printf("%2d%10s%10s%10s%9s\n", i, "no", "-", "-", "-");
+	}
+    }
+    printf("(N = %d threads)\n", num_threads);
+}
+
+/*
+ * printprodcons - Throughput of the producer/consumer benchmark for each
+ *     of n allocator setups, counting a malloc and a free per block
+ */
+static void printprodcons(int num_blocks, int n, char **names, stats_t *stats)
+{
+    int i;
+
+    printf("%-14s%6s%10s\n", "allocator", "valid", "Kops");
+    for (i = 0; i < n; i++) {
+	if (stats[i].valid)
+	    printf("%-14s%6s%10.0f\n", names[i], "yes",
+		   (stats[i].ops/1e3)/stats[i].secs);
+	else
+	    printf("%-14s%6s%10s\n", names[i], "no", "-");
+    }
+    printf("(%d blocks of 1 to %d bytes)\n", num_blocks, PC_MAX_SIZE);
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1014,13 +3304,29 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLsBDPI] [-A <n>] [-c <n>] [-C <file>] [-f <file>] [-H <MB>] [-j <n>] [-Q <n>] [-t <dir>] [-T <n>] [-u <file>] [-z <seed> [-Z <n>]]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-A <n>     Split the heap of -T into <n> arenas, one per thread.\n");
+    fprintf(stderr, "\t-B         Compare mm malloc, its variants and libc malloc side by side.\n");
+    fprintf(stderr, "\t-c <n>     Check the heap after every op, deeply every <n> ops.\n");
+    fprintf(stderr, "\t-C <file>  Compare them as -B does and also write the results to <file> as CSV.\n");
+    fprintf(stderr, "\t-D         Compare immediate and deferred coalescing in mm malloc.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <MB>    Compare TLB misses on a <MB> heap with and without huge pages.\n");
+    fprintf(stderr, "\t-I         Fill payloads with patterns and check them on every free and realloc.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to <n> traces at once in worker processes.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print per-call latency percentiles for mm malloc.\n");
+    fprintf(stderr, "\t-P         Count cache, TLB and branch misses and instructions per request.\n");
+    fprintf(stderr, "\t-Q <n>     Time a producer thread passing <n> blocks to a consumer that frees them.\n");
+    fprintf(stderr, "\t-s         Dump mm heap statistics at peak heap and at the end of each trace.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace from <n> threads at once.\n");
+    fprintf(stderr, "\t-u <file>  Log live bytes, heap size and inst_util after every op.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-z <seed>  Fuzz mm malloc with random traces and shrink the first failure.\n");
+    fprintf(stderr, "\t-Z <n>     Stop fuzzing after <n> traces.\n");
 }
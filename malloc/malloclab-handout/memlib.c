@@ -1,5 +1,18 @@
 /*
  * memlib.c - bridge to mmap
+ *
+ * Runs of pages given back with mem_unmap or mem_reset are kept in a
+ * small cache and handed out again by mem_map, so a trace replayed
+ * over and over under fcyc does not pay for mmap, munmap and fresh
+ * page faults on every iteration. A recycled run is not zeroed.
+ * The allocator calls mem_trim whenever it gives pages back, which
+ * unmaps the runs that have sat in the cache for a while beyond a small
+ * budget, so that the resident set still drops after a burst.
+ *
+ * With mem_set_hugepages(1), fresh runs are carved out of 2MB-aligned
+ * arenas that the kernel is asked (madvise MADV_HUGEPAGE) to back with
+ * transparent huge pages, cutting TLB misses on large heaps. The
+ * pagemap still tracks every 4KB page.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,15 +22,46 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
 
 #include "memlib.h"
 #include "pagemap.h"
 
+/* Kernels before 4.17 take the address as a hint; mem_map_at checks */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
 /* private variables */
 static int activity_counter = 0; /* to simulate other processes */
 
 static int page_count;
 
+/* Recently unmapped page runs, reused by mem_map before calling mmap */
+#define RUN_CACHE_SLOTS 256
+#define RUN_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define RUN_CACHE_IDLE_BYTES (2 * 1024 * 1024) /* mem_trim keeps this much */
+#define RUN_CACHE_DECAY_MS 1000                /* of runs idle for less */
+
+typedef struct {
+  char *addr;
+  size_t size;
+  long cached_ms;  /* when the run went into the cache */
+} page_run;
+
+static page_run run_cache[RUN_CACHE_SLOTS];
+static int cached_runs;
+static size_t cached_bytes;
+
+/* Huge-page arenas: reserved HUGE_ARENA_SIZE at a time and carved up */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_ARENA_SIZE (32 * HUGE_PAGE_SIZE)
+#define HUGE_ALIGN(size) (((size) + (HUGE_PAGE_SIZE - 1)) & ~(size_t)(HUGE_PAGE_SIZE - 1))
+
+static int use_huge_pages;
+static char *arena_next;   /* unused part of the current arena */
+static size_t arena_left;
+
 /* 
  * mem_init - initialize the memory system model
  */
@@ -31,13 +75,234 @@ void mem_init(void)
   }
 }
 
-static void unmap(void *p)
+/*
+ * take_cached_run - remove sz bytes from the best-fitting cached run,
+ *   or return NULL if no cached run is big enough
+ */
+static void *take_cached_run(size_t sz)
+{
+  int i, best = -1;
+  char *p;
+
+  for (i = 0; i < cached_runs; i++) {
+    if (run_cache[i].size >= sz &&
+        (best < 0 || run_cache[i].size < run_cache[best].size)) {
+      best = i;
+      if (run_cache[i].size == sz)
+        break;
+    }
+  }
+  if (best < 0)
+    return NULL;
+
+  p = run_cache[best].addr;
+  if (run_cache[best].size > sz) {
+    run_cache[best].addr += sz;
+    run_cache[best].size -= sz;
+  } else {
+    run_cache[best] = run_cache[--cached_runs];
+  }
+  cached_bytes -= sz;
+  return p;
+}
+
+/* now_ms - a coarse monotonic clock for aging cached runs */
+static long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void unmap_run(void *p, size_t sz)
+{
+  if (munmap(p, sz) < 0) {
+    fprintf(stderr, "munmap failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+}
+
+/*
+ * take_cached_range - remove exactly [p, p+sz) from the cached run that
+ *   holds it, keeping what is left on either side. Returns 0 if no
+ *   cached run holds the whole range.
+ */
+static int take_cached_range(char *p, size_t sz)
+{
+  page_run *r;
+  char *end;
+  long cached_ms;
+  int i;
+
+  for (i = 0; i < cached_runs; i++) {
+    r = &run_cache[i];
+    if (r->addr <= p && p + sz <= r->addr + r->size)
+      break;
+  }
+  if (i == cached_runs)
+    return 0;
+
+  end = r->addr + r->size;
+  cached_ms = r->cached_ms;
+  cached_bytes -= end - r->addr;
+  if (p > r->addr) {
+    r->size = p - r->addr;
+    cached_bytes += r->size;
+  } else {
+    *r = run_cache[--cached_runs];
+  }
+  if (end > p + sz) {
+    if (cached_runs == RUN_CACHE_SLOTS) {
+      unmap_run(p + sz, end - (p + sz));
+    } else {
+      run_cache[cached_runs].addr = p + sz;
+      run_cache[cached_runs].size = end - (p + sz);
+      run_cache[cached_runs].cached_ms = cached_ms;
+      cached_runs++;
+      cached_bytes += end - (p + sz);
+    }
+  }
+  return 1;
+}
+
+/*
+ * release_run - keep a run of no-longer-mapped pages for reuse. The run
+ *   is merged with any cached run it touches; when the cache is full the
+ *   smallest runs are given back to the kernel first.
+ */
+static void release_run(void *p, size_t sz)
+{
+  char *addr = p;
+  int i, smallest;
+
+  for (i = 0; i < cached_runs; i++) {
+    if (run_cache[i].addr + run_cache[i].size == addr ||
+        addr + sz == run_cache[i].addr) {
+      if (run_cache[i].addr < addr)
+        addr = run_cache[i].addr;
+      sz += run_cache[i].size;
+      cached_bytes -= run_cache[i].size;
+      run_cache[i--] = run_cache[--cached_runs];
+    }
+  }
+
+  while (cached_runs == RUN_CACHE_SLOTS || cached_bytes + sz > RUN_CACHE_MAX_BYTES) {
+    smallest = -1;
+    for (i = 0; i < cached_runs; i++)
+      if (run_cache[i].size < sz &&
+          (smallest < 0 || run_cache[i].size < run_cache[smallest].size))
+        smallest = i;
+    if (smallest < 0) {
+      unmap_run(addr, sz);
+      return;
+    }
+    unmap_run(run_cache[smallest].addr, run_cache[smallest].size);
+    cached_bytes -= run_cache[smallest].size;
+    run_cache[smallest] = run_cache[--cached_runs];
+  }
+
+  run_cache[cached_runs].addr = addr;
+  run_cache[cached_runs].size = sz;
+  run_cache[cached_runs].cached_ms = now_ms();
+  cached_runs++;
+  cached_bytes += sz;
+}
+
+/*
+ * huge_arena - reserve a 2MB-aligned region of at least sz bytes and
+ *   make it the current arena. What is left of the old arena goes to
+ *   the run cache.
+ */
+static void huge_arena(size_t sz)
 {
-  if (munmap(p, APAGE_SIZE) < 0) {
-    fprintf(stderr, "unexpected error in munmap: %s (%d)\n",
+  size_t len = HUGE_ALIGN(sz), slop;
+  char *raw, *p;
+
+  if (len < HUGE_ARENA_SIZE)
+    len = HUGE_ARENA_SIZE;
+
+  /* Over-reserve by one huge page, then trim to the aligned part */
+  raw = mmap(0, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (raw == MAP_FAILED) {
+    fprintf(stderr, "mmap failed: %s (%d)\n",
             strerror(errno), errno);
     abort();
   }
+  p = (char *)HUGE_ALIGN((uintptr_t)raw);
+  if ((slop = p - raw) > 0)
+    unmap_run(raw, slop);
+  if ((slop = HUGE_PAGE_SIZE - slop) > 0)
+    unmap_run(p + len, slop);
+
+  /* Without THP support this fails and the arena just uses 4KB pages */
+  madvise(p, len, MADV_HUGEPAGE);
+
+  if (arena_left > 0)
+    release_run(arena_next, arena_left);
+  arena_next = p;
+  arena_left = len;
+}
+
+/* 
+ * mem_set_hugepages - turn huge-page arenas on or off. Only call it
+ *   while nothing is mapped (before the first mem_map or right after
+ *   mem_reset); the run cache is emptied so runs from the old mode are
+ *   not handed out in the new one.
+ */
+void mem_set_hugepages(int on)
+{
+  mem_flush_cache();
+  if (arena_left > 0)
+    unmap_run(arena_next, arena_left);
+  arena_next = NULL;
+  arena_left = 0;
+  use_huge_pages = on;
+}
+
+/*
+ * mem_flush_cache - unmap every cached run. Safe at any time, since the
+ *   pages of a cached run are not in use.
+ */
+void mem_flush_cache(void)
+{
+  int i;
+
+  for (i = 0; i < cached_runs; i++)
+    unmap_run(run_cache[i].addr, run_cache[i].size);
+  cached_runs = 0;
+  cached_bytes = 0;
+}
+
+/*
+ * mem_trim - unmap the largest of the runs that have been cached for
+ *   RUN_CACHE_DECAY_MS or more, until the cache holds no more than
+ *   RUN_CACHE_IDLE_BYTES. Runs a replay is about to reuse, or that a
+ *   heap in steady state keeps recycling, stay cached.
+ */
+void mem_trim(void)
+{
+  long now;
+  int i, largest;
+
+  if (cached_bytes <= RUN_CACHE_IDLE_BYTES)
+    return;
+
+  now = now_ms();
+  while (cached_bytes > RUN_CACHE_IDLE_BYTES) {
+    largest = -1;
+    for (i = 0; i < cached_runs; i++)
+      if (now - run_cache[i].cached_ms >= RUN_CACHE_DECAY_MS &&
+          (largest < 0 || run_cache[i].size > run_cache[largest].size))
+        largest = i;
+    if (largest < 0)
+      return;
+    unmap_run(run_cache[largest].addr, run_cache[largest].size);
+    cached_bytes -= run_cache[largest].size;
+    run_cache[largest] = run_cache[--cached_runs];
+  }
 }
 
 /* 
@@ -45,7 +310,7 @@ static void unmap(void *p)
  */
 void mem_reset(void)
 {
-  pagemap_for_each(unmap);
+  pagemap_for_each_run(release_run);
   page_count = 0;
   activity_counter = 0;
 }
@@ -67,7 +332,6 @@ size_t mem_heapsize(void)
 void *mem_map(size_t sz)
 {
   void *p;
-  size_t i;
   
   if (sz & (APAGE_SIZE - 1)) {
     fprintf(stderr, "mem_map: requested size is not a multiple of %d: %ld\n",
@@ -76,30 +340,80 @@ void *mem_map(size_t sz)
   }
 
   activity_counter++;
-  if ((activity_counter & (activity_counter - 1)) == 0) {
-    /* allocate a page to ensure that mem_map results are not
-       always sequential */
-    mmap(0, APAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if ((p = take_cached_run(sz)) == NULL && use_huge_pages) {
+    if (sz > arena_left)
+      huge_arena(sz);
+    p = arena_next;
+    arena_next += sz;
+    arena_left -= sz;
   }
+  else if (p == NULL) {
+    if ((activity_counter & (activity_counter - 1)) == 0) {
+      /* allocate a page to ensure that mem_map results are not
+         always sequential */
+      mmap(0, APAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    }
 
-  p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (p == MAP_FAILED) {
-    fprintf(stderr, "mmap failed: %s (%d)\n",
-            strerror(errno), errno);
-    abort();
+    p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "mmap failed: %s (%d)\n",
+              strerror(errno), errno);
+      abort();
+    }
   }
 
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    pagemap_modify(p + i, 1);
-    page_count++;
+  if (pagemap_modify_range(p, sz / APAGE_SIZE, 1) != NULL) {
+    fprintf(stderr, "internal error: page is already mapped\n");
+    abort();
   }
+  page_count += sz / APAGE_SIZE;
   
   return p;
 }
 
+/*
+ * mem_map_at - map sz bytes at exactly p, taking them from the run
+ *   cache, the current huge-page arena or the kernel. Returns NULL if
+ *   any of the pages is in use.
+ */
+void *mem_map_at(void *p, size_t sz)
+{
+  char *q;
+
+  if ((((uintptr_t)p) | sz) & (APAGE_SIZE - 1)) {
+    fprintf(stderr, "mem_map_at: address or size is not page-aligned: %p %ld\n",
+            p, sz);
+    abort();
+  }
+
+  activity_counter++;
+  if (use_huge_pages && p == arena_next && sz <= arena_left) {
+    arena_next += sz;
+    arena_left -= sz;
+  }
+  else if (!take_cached_range(p, sz)) {
+    q = mmap(p, sz, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANON | MAP_FIXED_NOREPLACE, -1, 0);
+    if (q == MAP_FAILED)
+      return NULL;
+    if (q != p) {
+      unmap_run(q, sz);
+      return NULL;
+    }
+  }
+
+  if (pagemap_modify_range(p, sz / APAGE_SIZE, 1) != NULL) {
+    fprintf(stderr, "internal error: page is already mapped\n");
+    abort();
+  }
+  page_count += sz / APAGE_SIZE;
+
+  return p;
+}
+
 void mem_unmap(void *p, size_t sz)
 {
-  size_t i;
+  void *bad;
   
   if (((uintptr_t)p) & (APAGE_SIZE - 1)) {
     fprintf(stderr, "mem_unmap: given address is not page-aligned: %p\n",
@@ -113,21 +427,12 @@ void mem_unmap(void *p, size_t sz)
     abort();
   }
   
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    if (!pagemap_is_mapped(p+i)) {
-      fprintf(stderr, "mem_unmap: given page is not mapped: %p (in %p:%p)\n",
-              p + i, p, p + sz);
-      abort();
-    }      
-
-    pagemap_modify(p + i, 0);
-    
-    --page_count;
-  }
-
-  if (munmap(p, sz) < 0) {
-    fprintf(stderr, "munmap failed: %s (%d)\n",
-            strerror(errno), errno);
+  if ((bad = pagemap_modify_range(p, sz / APAGE_SIZE, 0)) != NULL) {
+    fprintf(stderr, "mem_unmap: given page is not mapped: %p (in %p:%p)\n",
+            bad, p, p + sz);
     abort();
   }
+  page_count -= sz / APAGE_SIZE;
+
+  release_run(p, sz);
 }
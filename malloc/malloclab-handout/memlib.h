@@ -7,4 +7,16 @@ size_t mem_pagesize(void);
 void *mem_map(size_t);
 void mem_unmap(void *, size_t);
 
+/* Map the pages right at an address, e.g. to grow a run; NULL if taken */
+void *mem_map_at(void *, size_t);
+
+/* Carve fresh pages out of 2MB-aligned, huge-page backed arenas */
+void mem_set_hugepages(int on);
+
+/* Give the pages of the cached runs back to the kernel */
+void mem_flush_cache(void);
+
+/* ... or only those beyond a small idle budget */
+void mem_trim(void);
+
 size_t mem_heapsize(void);
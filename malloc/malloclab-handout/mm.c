@@ -1,21 +1,74 @@
 /*
- * mm-naive.c - The least memory-efficient malloc package.
- * 
- * In this naive approach, a block is allocated by allocating a
- * new page as needed.  A block is pure payload. There are no headers or
- * footers.  Blocks are never coalesced or reused.
+ * mm.c - Segregated-fit malloc package built on page chunks.
  *
- * NOTE TO STUDENTS: Replace this header comment with your own header
- * comment that gives a high level description of your solution.
+ * Memory is requested from mem_map in page chunks. Every chunk starts
+ * with a page_node that links it into the chunk list and records the
+ * chunk's size, followed by a prologue block, the usable blocks and an
+ * epilogue header:
+ *
+ *   | next | prev | size | prolog hdr | prolog ftr | blocks ... | epilog hdr |
+ *
+ * Each block has a header holding its size, its alloc bit and a bit
+ * telling whether the block before it is allocated. Only free blocks
+ * carry a footer, since coalescing only ever needs to find the start
+ * of a free previous block, so an allocated block costs one word of
+ * overhead instead of two. Freed blocks are coalesced with their
+ * neighbors right away.
+ *
+ * Free blocks of up to SMALL_MAX bytes keep a next/prev pointer pair in
+ * their payload and live on exact-size bins, one per 16-byte size. A
+ * bitmap of non-empty bins lets mm_malloc jump straight to the smallest
+ * bin that can satisfy a request. Larger free blocks instead form a
+ * treap ordered by size and address, its links also kept in the payload,
+ * so the best fit for a large request is found in logarithmic time
+ * however fragmented the heap gets.
+ *
+ * mm_realloc resizes in place whenever it can: shrinking gives the tail
+ * back to the free lists, and growing absorbs a free block that follows.
+ *
+ * Requests of up to SLAB_MAX bytes come from slab pages instead: pages
+ * dedicated to one block size, with a free bitmap in a small header at
+ * the start of the page and no per-block header at all. The pagemap's
+ * per-page info marks a slab page and holds its block size.
+ *
+ * Requests of LARGE_THRESHOLD bytes or more skip the chunks and get a
+ * page run of their own, which mm_free unmaps immediately. Such a run
+ * has no header at all; its size lives in the pagemap's per-page info.
+ *
+ * When a free leaves a whole chunk empty, the chunk is handed back with
+ * mem_unmap. One empty chunk of the standard size is kept in reserve so
+ * that a heap oscillating around a chunk boundary does not map and unmap
+ * the same pages over and over.
+ *
+ * mm_set_deferred(1) defers coalescing: freed small blocks wait in quick
+ * bins, where a request of the same size picks them straight back up,
+ * and are coalesced in batches.
+ *
+ * mm_set_threaded(1) makes the package safe to call from many threads:
+ * the heap is then shared behind one lock, and each thread keeps a
+ * cache of small blocks that it refills and flushes in batches. Tiny
+ * blocks then come from the thread caches rather than from slabs.
+ * mm_set_arenas splits the heap into per-CPU arenas, each with its own
+ * lock; a block freed from another arena's CPU goes back to its owner
+ * through a lock-free stack, which the owner's next malloc empties into
+ * its thread cache.
+ *
+ * mm_check verifies the heap invariants: cheaply around the block the
+ * last request touched, or by walking every chunk and free list.
  */
+#define _GNU_SOURCE // sched_getcpu
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "pagemap.h"
 
 /* always use 16-byte alignment */
 #define ALIGNMENT 16
@@ -29,23 +82,51 @@
 // VARIABLES AND MACROS FOR SETTING UP BLOCK INFORMATION
 typedef size_t block_header;
 typedef size_t block_footer;
+
 typedef struct page_node
 {
   struct page_node *next;
   struct page_node *prev;
+  size_t size; // bytes obtained from mem_map for this chunk
 } page_node;
 
+typedef struct free_block
+{
+  struct free_block *next;
+  struct free_block *prev;
+} free_block;
+
+// a free block in the tree of large free blocks
+typedef struct tree_block
+{
+  struct tree_block *left;
+  struct tree_block *right;
+  struct tree_block *parent; // NULL at the root
+} tree_block;
+
 #define OVERHEAD (sizeof(block_header) + sizeof(block_footer))
-#define PADDING (sizeof(size_t))                                                                                         // 8 bytes for padding
-#define PAGE_OVERHEAD (sizeof(page_node) + PADDING + sizeof(block_header) + sizeof(block_footer) + sizeof(block_header)) // 48 bytes
+#define ALLOC_OVERHEAD (sizeof(block_header)) // allocated blocks have no footer
+#define PAGE_OVERHEAD (sizeof(page_node) + sizeof(block_header) + sizeof(block_footer) + sizeof(block_header)) // 48 bytes
 #define WSIZE 8                                                                                                          // word
-#define DSIZE 8                                                                                                          // double word
+#define DSIZE 16                                                                                                         // double word
+
+// smallest block that can hold a header, footer and the free list links,
+// so that every allocated block can later be freed in place
+#define MIN_BLOCK_SIZE (OVERHEAD + sizeof(free_block))
 
-//Given a payload pointer, get the header or footer pointer
+// smallest chunk requested from mem_map at a time
+#define CHUNK_SIZE (16 * 4096)
+
+// empty standard-size chunks kept mapped instead of being released
+#define KEEP_EMPTY_CHUNKS 1
+
+// Given a payload pointer, get the header or footer pointer
+// (only free blocks have a footer)
 #define HDRP(bp) ((char *)(bp) - sizeof(block_header))
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - OVERHEAD)
 
 // Given a payload pointer, get the next or previous payload pointer
+// (PREV_BLKP reads the previous block's footer, so it must be free)
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
 #define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE((char *)(bp)-OVERHEAD))
 
@@ -53,180 +134,2092 @@ typedef struct page_node
 #define GET(p) (*(size_t *)(p))
 #define PUT(p, val) (*(size_t *)(p) = (val))
 
-// Combine a size and alloc bit
+// Combine a size and alloc bits
 #define PACK(size, alloc) ((size) | (alloc))
+#define PREV_ALLOC 0x2  // header bit: the previous block is allocated
+#define FIRST_BLOCK 0x4 // header bit: the block starts right after its chunk's prologue
 
-// Given a header pointer, get the alloc or size
+// Given a header pointer, get the alloc bits or size
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_FLAGS(p) (GET(p) & (PREV_ALLOC | FIRST_BLOCK))
 #define GET_SIZE(p) (GET(p) & ~0xF)
+
+// Set or clear the PREV_ALLOC bit in a header. In thread-safe mode the
+// header may be an allocated block's whose size its user is reading with
+// GET_SIZE_SHARED, without the arena lock, so the store is atomic.
+#define SET_PREV_ALLOC(p) __atomic_store_n((size_t *)(p), GET(p) | PREV_ALLOC, __ATOMIC_RELAXED)
+#define CLEAR_PREV_ALLOC(p) __atomic_store_n((size_t *)(p), GET(p) & ~PREV_ALLOC, __ATOMIC_RELAXED)
+
+// Get an allocated block's size from its header without the arena lock
+#define GET_SIZE_SHARED(p) (__atomic_load_n((size_t *)(p), __ATOMIC_RELAXED) & ~0xF)
+
+// Given the payload pointer of a chunk's first block, get the chunk
+#define CHUNKP(bp) ((page_node *)((char *)(bp)-PAGE_OVERHEAD))
+
+// Is the block the only block of its chunk?
+#define IS_WHOLE_CHUNK(bp) ((GET(HDRP(bp)) & FIRST_BLOCK) && GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+/*********************************************************************************/
+// SEGREGATED FREE LIST CLASSES
+// Blocks up to SMALL_MAX bytes get one bin per 16-byte size. Larger free
+// blocks live in the free tree instead, but are still grouped by power of
+// two when mm_get_stats reports on them, the last class catching the rest.
+#define SMALL_MAX 512
+#define NUM_EXACT ((SMALL_MAX - MIN_BLOCK_SIZE) / ALIGNMENT + 1) // 31 bins: 32, 48, ..., 512
+#define LOG_SMALL_MAX 9                                           // log2(SMALL_MAX)
+#define NUM_CLASSES MM_STATS_CLASSES                              // 64, one bit per class in nonempty_classes
+/*********************************************************************************/
+// FREE TREE
+// Free blocks above SMALL_MAX bytes form a treap keyed by (size, address):
+// a binary search tree on the key that is also a heap on a priority
+// hashed from the block address. The hash stands in for the random
+// priority of a textbook treap, so nodes need no room for one and the
+// expected depth is logarithmic whatever order the blocks arrive in.
+//
+// The tree-sized block freed or split off most recently is held out of the
+// tree in the arena's hot_block slot, and goes into the tree only when the
+// next one takes its place. Most such blocks are allocated again or
+// coalesced with a neighbor while still hot, which then costs no tree
+// insert or remove at all. find_fit still compares the hot block with the
+// tree's best fit, so the heap stays best fit.
+#define IS_TREE_SIZE(size) ((size) > SMALL_MAX)
+#define TREE_PRIORITY(t) (((uintptr_t)(t) >> 4) * 0x9E3779B97F4A7C15UL)
+/*********************************************************************************/
+// LARGE OBJECTS
+// A large object is a page run from mem_map holding nothing but the payload.
+// The first page's pagemap info is the run size tagged with PAGE_LARGE, so
+// mm_free recognizes a large object from its page-aligned pointer alone.
+#define LARGE_THRESHOLD (16 * 1024)
+#define PAGE_LARGE 0x1
+#define IS_PAGE_ALIGNED(p) (((uintptr_t)(p) & (mem_pagesize() - 1)) == 0)
+/*********************************************************************************/
+// SLABS
+// A slab is a single page of equal-size blocks. It starts with a slab header
+// whose bitmap has a bit set for every free slot; the blocks follow. The
+// page's pagemap info is the block size tagged with PAGE_SLAB, so mm_free
+// recognizes a slab block, and mm_realloc learns its size, from the pagemap.
+// Slabs with a free slot are kept on a list per size class.
+typedef struct slab
+{
+  struct slab *next; // partial slabs of the same class
+  struct slab *prev;
+  int free_count;    // number of free slots
+  int slots;         // number of slots in the page
+  uint64_t free_map[4];
+} slab;
+
+#define SLAB_MAX 64                                // largest request served from a slab
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)        // 16, 32, 48 and 64 bytes
+#define SLAB_HEADER ALIGN(sizeof(slab))            // slot 0 starts here
+#define PAGE_SLAB 0x2
+#define SLAB_OF(p) ((slab *)((uintptr_t)(p) & ~(uintptr_t)(mem_pagesize() - 1)))
 /*********************************************************************************/
 // HELPER FUNCTIONS
-/* Set a block to allocated 
- * Update block headers/footers as needed 
- * Update free list if applicable 
- * Split block if applicable 
+/* Set a block to allocated
+ * Update block headers/footers as needed
+ * Update free list if applicable
+ * Split block if applicable
  */
-static void set_allocated(void *b, size_t size);
+static void set_allocated(void *bp, size_t size);
 
-/* Request more memory by calling mem_map 
- * Initialize the new chunk of memory as applicable 
- * Update free list if applicable 
+/* Request more memory by calling mem_map
+ * Initialize the new chunk of memory as applicable
+ * Update free list if applicable
+ * Returns the payload pointer of the new chunk's free block
  */
-static void extend(size_t s);
+static void *extend(size_t s);
 
-// /* Coalesce a free block if applicable
-//  * Returns pointer to new coalesced block
-//  */
-// static void *coalesce(void *bp);
+/* Coalesce a free block if applicable
+ * Returns pointer to new coalesced block
+ */
+static void *coalesce(void *bp);
 
 static void add_pages(void *pg);
+static void *resize_in_place(void *bp, size_t size, size_t *payload);
+static void *large_malloc(size_t size);
+static int large_free(void *ptr);
+static void remove_pages(page_node *pg);
+static int release_chunk(void *bp);
+static int size_class(size_t size);
+static void *find_fit(size_t size);
+static void add_free_block(void *bp);
+static void remove_free_block(void *bp);
+static int tree_before(size_t size, void *a, tree_block *b);
+static int tree_less(tree_block *a, tree_block *b);
+static void tree_insert(tree_block *node);
+static void tree_remove(tree_block *node);
+static void *tree_best_fit(size_t size);
+static void *slab_malloc(size_t size);
+static int slab_free(void *ptr);
+static slab *new_slab(int cls);
+static void *map_pages(size_t size);
+static void *map_pages_at(void *p, size_t size);
+static void unmap_pages(void *p, size_t size);
+/*****************************************************************************/
+
+// ARENAS
+// The chunk heap, its free lists and its free tree make up an arena. There
+// is a single arena unless thread-safe mode is given more with
+// mm_set_arenas, in which case each thread is bound to the arena of the
+// CPU it first allocates on, or of the CPU named by mm_bind_arena. A
+// thread only ever works on its own arena, which heap points at, under
+// the arena's lock. The pagemap's per-page info of every chunk page then
+// names the chunk's arena (tagged PAGE_ARENA), so that a block freed by a
+// thread of another arena is pushed on its owner's remote_frees stack
+// with a compare-and-swap instead. The next malloc from one of the owner's
+// threads takes the whole stack, again without the lock, and moves the
+// small blocks into its thread cache, so that a block passed from a
+// producer thread to a consumer comes back to the producer without either
+// of them taking a lock. Whatever is left over is freed the next time
+// the owner takes its lock.
+typedef struct arena
+{
+  pthread_mutex_t lock;
+  page_node *first_pg_chunk;
+  int empty_chunks;                    // chunks whose whole body is a single free block
+  free_block *free_lists[NUM_CLASSES]; // heads of the segregated free lists...
+  uint64_t nonempty_classes;           // ... and a bit set for each non-empty list
+  tree_block *free_tree;               // root of the tree of free blocks above SMALL_MAX bytes
+  void *hot_block;                     // a tree-sized free block kept out of the tree, or NULL
+  int live_blocks;                     // allocated blocks in the chunks, cached or parked ones included
+  void *last_block;                    // the block mm_check's fast mode looks at
+  free_block *remote_frees;            // blocks other arenas' threads have freed
+} __attribute__((aligned(64))) arena;
+
+#define MAX_ARENAS 64
+#define PAGE_ARENA 0x4
+#define ARENA_INFO(a) ((((uintptr_t)((a)-arenas)) << 3) | PAGE_ARENA)
+#define INFO_ARENA(info) (&arenas[(info) >> 3])
+
+static arena arenas[MAX_ARENAS];
+static int num_arenas = 1;
+static __thread arena *heap = &arenas[0];
+
+static arena *thread_arena(void);
+static void lock_heap(void);
+static void unlock_heap(void);
+static void remote_free(arena *a, void *bp);
+static void drain_remote_frees(void);
+static void take_remote_frees(void);
+static uintptr_t page_info(void *p);
+static void lock_map(void);
+static void unlock_map(void);
 /*****************************************************************************/
 
-void *current_avail = NULL;
-int current_avail_size = 0;
-static page_node *first_pg_chunk = NULL;
+// slabs with a free slot, per slab class, and whether a class already
+// has an empty slab in reserve
+static slab *partial_slabs[SLAB_CLASSES];
+static int empty_slab[SLAB_CLASSES];
+
+// running totals for mm_get_stats, reset by mm_init
+static int slab_pages = 0;
+static size_t slab_used_bytes = 0;
+static int large_runs = 0;
+static size_t large_bytes = 0;
+static unsigned long map_calls = 0, unmap_calls = 0;
+static size_t mapped_bytes = 0, unmapped_bytes = 0;
+/*****************************************************************************/
+// THREAD-SAFE MODE
+// In thread-safe mode each arena is guarded by its own lock, and map_lock
+// guards mem_map, mem_unmap, the pagemap and the large object counters;
+// a thread holding an arena lock may take map_lock, never the reverse.
+// Small blocks are served from a per-thread cache of ready-made blocks
+// that is refilled from, and flushed back to, the heap TCACHE_BATCH
+// blocks at a time, so a thread only takes the lock once per batch.
+// Cached blocks keep their allocated header and are never coalesced.
+#define TCACHE_MAX 512                                           // largest block size kept in a thread cache
+#define TCACHE_BINS ((TCACHE_MAX - MIN_BLOCK_SIZE) / ALIGNMENT + 1) // one bin per 16-byte size
+#define TCACHE_BATCH 16                                          // blocks moved per refill or flush
+#define TCACHE_LIMIT (2 * TCACHE_BATCH)                          // flush a bin once it holds this many
 
-static void extend(size_t new_size)
+typedef struct tcache
 {
-  // get a group of contiguous pages from mem_map
-  current_avail_size = PAGE_ALIGN(new_size);
+  unsigned long generation; // heap_generation the cached blocks belong to
+  int registered;           // has the exit destructor been set up
+  free_block *bins[TCACHE_BINS];
+  int counts[TCACHE_BINS];
+} tcache;
 
-  // print the aligned page size
-  printf("%zu\n", current_avail_size);
+static int threaded = 0;
+static unsigned long heap_generation = 0;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread unsigned long heap_bound; // heap_generation heap was bound in
+static __thread int thread_cpu = -1;      // the CPU named by mm_bind_arena
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static __thread tcache thread_cache;
 
-  // mem map returns a pointer so printing the size will return 8
-  current_avail = mem_map(current_avail_size);
+static void *heap_malloc(size_t size);
+static void heap_free(void *bp);
+static tcache *get_tcache(void);
+static void *tcache_refill(tcache *tc, int bin, size_t size);
+static void tcache_flush(tcache *tc, int bin, int count);
+/*****************************************************************************/
+// DEFERRED COALESCING
+// With deferred coalescing on, mm_free puts blocks of up to QUICK_MAX bytes
+// in a quick bin for their exact size instead of coalescing them. Like the
+// blocks in a thread cache they keep their allocated header, so the rest
+// of the heap never sees them, and heap_malloc hands them out again first.
+// The bins are emptied into the heap in one batch once they hold more than
+// QUICK_LIMIT bytes or half of the heap's live blocks, and before a request
+// that finds no fit maps a chunk. The second bound keeps a heap that is
+// being emptied from pinning chunks with a few parked blocks each, which
+// release_chunk would otherwise have unmapped.
+// Threaded mode does not use them; its thread caches already defer.
+#define QUICK_MAX SMALL_MAX
+#define QUICK_BINS NUM_EXACT
+#define QUICK_LIMIT (CHUNK_SIZE / 4)
 
-  // if mem map returns null then return null
-  if (current_avail == NULL)
+static int deferred = 0;
+static free_block *quick_bins[QUICK_BINS];
+static size_t quick_bytes = 0; // bytes waiting in the quick bins
+static int quick_blocks = 0;   // ... and how many blocks they are
+
+static void quick_free(void *bp);
+static void quick_flush(void);
+/*****************************************************************************/
+// HEAP CHECKER
+// The fast mode of mm_check looks only at each arena's last_block, the block
+// the most recent heap operation allocated, freed or resized, and its
+// neighbors. The deep mode walks every chunk and every free list.
+
+static int check_arena(int deep);
+static int check_block(void *bp);
+static int check_chunk(page_node *pg, int *free_blocks);
+static int check_lists(int free_blocks);
+static int check_tree(tree_block *t, tree_block *lo, tree_block *hi, int *count, int *empty);
+static int check_slabs(void);
+static int check_quick(void);
+/*****************************************************************************/
+
+/*
+ * mm_set_threaded - Turn thread-safe mode on or off. Only call it while
+ *     no other thread is using the allocator, and before mm_init.
+ */
+void mm_set_threaded(int on)
+{
+  threaded = on;
+}
+
+/*
+ * mm_set_arenas - Split the heap into n arenas in thread-safe mode, for
+ *     up to MAX_ARENAS CPUs. Only call it before mm_init.
+ */
+void mm_set_arenas(int n)
+{
+  num_arenas = (n < 1) ? 1 : (n > MAX_ARENAS) ? MAX_ARENAS : n;
+}
+
+/*
+ * mm_bind_arena - Bind the calling thread to the arena of the given CPU
+ *     instead of the one it runs on, e.g. to spread threads over the
+ *     arenas on a machine with fewer CPUs. The blocks in the thread's
+ *     cache belong to its old arena, so they are flushed back to it first.
+ */
+void mm_bind_arena(int cpu)
+{
+  tcache *tc = &thread_cache;
+  int bin;
+
+  if (threaded && heap_bound == heap_generation && tc->generation == heap_generation)
   {
-    return;
+    for (bin = 0; bin < TCACHE_BINS; bin++)
+    {
+      if (tc->counts[bin] > 0)
+      {
+        tcache_flush(tc, bin, tc->counts[bin]);
+      }
+    }
   }
 
-  void *contig_pgs = current_avail;
+  thread_cpu = cpu;
+  heap_bound = 0;
+}
+
+/*
+ * mm_set_deferred - Turn deferred coalescing on or off. Only call it
+ *     before mm_init.
+ */
+void mm_set_deferred(int on)
+{
+  deferred = on;
+}
 
-  printf("%zu\n", mem_heapsize() / 4096);
+/*
+ * mm_init - initialize the malloc package.
+ */
+int mm_init(void)
+{
+  int i;
 
-  // add information for the bytes
-  // move past the first 16 bytes allocated for the page pointers
-  contig_pgs = contig_pgs + sizeof(page_node);
+  memset(arenas, 0, sizeof(arenas));
+  for (i = 0; i < MAX_ARENAS; i++)
+  {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  }
+  heap = &arenas[0];
+  memset(quick_bins, 0, sizeof(quick_bins));
+  quick_bytes = 0;
+  quick_blocks = 0;
+  memset(partial_slabs, 0, sizeof(partial_slabs));
+  memset(empty_slab, 0, sizeof(empty_slab));
+  slab_pages = 0;
+  slab_used_bytes = 0;
+  large_runs = 0;
+  large_bytes = 0;
+  map_calls = unmap_calls = 0;
+  mapped_bytes = unmapped_bytes = 0;
 
-  PUT(contig_pgs, 0);                                                         // add padding of 8 bytes
-  PUT(contig_pgs + (1 * WSIZE), PACK(DSIZE, 1));                              // Prologue Header
-  PUT(contig_pgs + (2 * WSIZE), PACK(DSIZE, 1));
-  // print the current available size
-  printf("%zu\n", current_avail_size - PAGE_OVERHEAD);                           // Prologue Footer
-  PUT(contig_pgs + (3 * WSIZE), PACK(current_avail_size - PAGE_OVERHEAD, 0)); // Header
-  contig_pgs = contig_pgs + 32;
-  PUT(FTRP(contig_pgs), PACK(current_avail_size - PAGE_OVERHEAD, 0)); // Footer
-  PUT(FTRP(contig_pgs) + WSIZE, PACK(0, 1));                          // Epilogue Header
-  add_pages(contig_pgs);                                              // add the page node to the linked list
+  // blocks still sitting in thread caches belonged to the old heap, and
+  // threads are bound to an arena afresh
+  heap_generation++;
+  return 0;
 }
 
-// build page linked list
-static void add_pages(void *pg)
+/*
+ * mm_malloc - Allocate a block from the smallest non-empty size class
+ *     or the best-fitting large free block, grabbing a new chunk of pages
+ *     if necessary.
+ */
+void *mm_malloc(size_t size)
 {
-  // cast pg to page node
-  page_node *new_pg_chunk = (page_node *)(pg);
+  size_t new_size;
+  void *bp;
 
-  if (first_pg_chunk == NULL)
+  // check if the user requests 0
+  if (size == 0)
   {
-    new_pg_chunk->next = NULL;
-    new_pg_chunk->prev = NULL;
-    first_pg_chunk = new_pg_chunk;
+    return NULL;
   }
-  else
+
+  if (size <= SLAB_MAX && !threaded)
   {
-    // set the first page next
-    first_pg_chunk->next = new_pg_chunk;
+    return slab_malloc(size);
+  }
 
-    // set the new page chunk previous to first page chunk
-    new_pg_chunk->prev = first_pg_chunk;
+  if (size >= LARGE_THRESHOLD)
+  {
+    if (!threaded)
+    {
+      return large_malloc(size);
+    }
+    lock_map();
+    bp = large_malloc(size);
+    unlock_map();
+    return bp;
+  }
 
-    // set the new page chunk next to null
-    new_pg_chunk->next = NULL;
+  new_size = ALIGN(size + ALLOC_OVERHEAD);
+  if (new_size < MIN_BLOCK_SIZE)
+  {
+    new_size = MIN_BLOCK_SIZE;
+  }
 
-    /* This code is for the explicit linked list version */
-    // // set the first page chunk previous
-    // first_pg_chunk->prev = new_pg_chunk;
+  if (!threaded)
+  {
+    return heap_malloc(new_size);
+  }
 
-    // // set the new page chunk to previous
-    // new_pg_chunk->next = first_pg_chunk;
+  if (__atomic_load_n(&thread_arena()->remote_frees, __ATOMIC_RELAXED) != NULL)
+  {
+    take_remote_frees();
+  }
 
-    // // set the new page chunkj previous
-    // new_pg_chunk->prev = NULL;
+  if (new_size <= TCACHE_MAX)
+  {
+    tcache *tc = get_tcache();
+    int bin = (new_size - MIN_BLOCK_SIZE) / ALIGNMENT;
+    free_block *fb = tc->bins[bin];
 
-    // // set the first page chunk as the new page chunk
-    // first_pg_chunk = new_pg_chunk;
+    if (fb == NULL)
+    {
+      return tcache_refill(tc, bin, new_size);
+    }
+    tc->bins[bin] = fb->next;
+    tc->counts[bin]--;
+    return fb;
   }
+
+  lock_heap();
+  bp = heap_malloc(new_size);
+  unlock_heap();
+  return bp;
 }
 
-/* 
- * mm_init - initialize the malloc package.
+/*
+ * mm_free - Mark the block free, merge it with any free neighbors
+ *     and put the result on its size class list or in the free tree.
  */
-int mm_init(void)
+void mm_free(void *ptr)
 {
-  current_avail = NULL;
-  current_avail_size = 0;
-  first_pg_chunk = NULL;
-  return 0;
+  size_t size;
+  uintptr_t info;
+
+  if (ptr == NULL)
+  {
+    return;
+  }
+
+  if (!threaded)
+  {
+    if (!large_free(ptr) && !slab_free(ptr))
+    {
+      if (deferred)
+      {
+        quick_free(ptr);
+      }
+      else
+      {
+        heap_free(ptr);
+      }
+    }
+    return;
+  }
+
+  info = page_info(ptr);
+  if (info & PAGE_LARGE)
+  {
+    lock_map();
+    large_free(ptr);
+    unlock_map();
+    return;
+  }
+
+  // a block of another arena goes back to its owner
+  if (INFO_ARENA(info) != thread_arena())
+  {
+    remote_free(INFO_ARENA(info), ptr);
+    return;
+  }
+
+  size = GET_SIZE_SHARED(HDRP(ptr));
+  if (size <= TCACHE_MAX)
+  {
+    tcache *tc = get_tcache();
+    int bin = (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+    free_block *fb = (free_block *)(ptr);
+
+    fb->next = tc->bins[bin];
+    tc->bins[bin] = fb;
+    if (++tc->counts[bin] >= TCACHE_LIMIT)
+    {
+      tcache_flush(tc, bin, TCACHE_BATCH);
+    }
+    return;
+  }
+
+  lock_heap();
+  heap_free(ptr);
+  unlock_heap();
 }
 
-/* 
- * mm_malloc - Allocate a block by using bytes from current_avail,
- *     grabbing a new page if necessary.
+/*
+ * mm_realloc - Resize a block, in place when possible, otherwise by
+ *     moving the payload to a newly allocated block.
  */
-void *mm_malloc(size_t size)
+void *mm_realloc(void *ptr, size_t size)
 {
-  // print the size requested by the user
-  printf("%zu\n", size);
+  void *newp;
+  size_t payload;
+  uintptr_t info;
+  arena *own;
+
+  if (ptr == NULL)
+  {
+    return mm_malloc(size);
+  }
 
-  // check if the user requests 0
   if (size == 0)
+  {
+    mm_free(ptr);
+    return NULL;
+  }
+
+  if (!threaded)
+  {
+    newp = resize_in_place(ptr, size, &payload);
+  }
+  else if ((info = page_info(ptr)) & PAGE_LARGE)
+  {
+    lock_map();
+    newp = resize_in_place(ptr, size, &payload);
+    unlock_map();
+  }
+  else
+  {
+    // resize under the lock of the arena that owns the block, which
+    // need not be the calling thread's
+    own = thread_arena();
+    heap = INFO_ARENA(info);
+    pthread_mutex_lock(&heap->lock);
+    newp = resize_in_place(ptr, size, &payload);
+    pthread_mutex_unlock(&heap->lock);
+    heap = own;
+  }
+
+  if (newp != NULL)
+  {
+    return newp;
+  }
+
+  newp = mm_malloc(size);
+  if (newp == NULL)
+  {
+    return NULL;
+  }
+  memcpy(newp, ptr, (payload < size) ? payload : size);
+  mm_free(ptr);
+  return newp;
+}
+
+/*
+ * resize_in_place - Try to make bp's payload hold size bytes without
+ *     moving it. Returns bp on success, or NULL with *payload set to the
+ *     block's current payload size so the caller can move it.
+ */
+static void *resize_in_place(void *bp, size_t size, size_t *payload)
+{
+  size_t current_size, new_size;
+  uintptr_t info;
+  void *next;
+
+  // a large object can give back whole pages, and grow into the pages
+  // right after its run if nothing else has them
+  if (IS_PAGE_ALIGNED(bp) && ((info = page_info(bp)) & PAGE_LARGE))
+  {
+    size_t run_size = info & ~(uintptr_t)PAGE_LARGE;
+    size_t new_run_size = PAGE_ALIGN(size);
+
+    *payload = run_size;
+    if (size < LARGE_THRESHOLD)
+    {
+      return NULL;
+    }
+    if (new_run_size > run_size)
+    {
+      if (map_pages_at((char *)bp + run_size, new_run_size - run_size) == NULL)
+      {
+        return NULL;
+      }
+      large_bytes += new_run_size - run_size;
+      pagemap_set_info(bp, new_run_size | PAGE_LARGE);
+    }
+    else if (new_run_size < run_size)
+    {
+      unmap_pages((char *)bp + new_run_size, run_size - new_run_size);
+      large_bytes -= run_size - new_run_size;
+      pagemap_set_info(bp, new_run_size | PAGE_LARGE);
+    }
+    return bp;
+  }
+
+  // a slab block stays put as long as its slot is big enough; threaded
+  // mode has no slabs, and may not use the pagemap's lookup cache here
+  if (!threaded && !IS_PAGE_ALIGNED(bp) && ((info = page_info(SLAB_OF(bp))) & PAGE_SLAB))
+  {
+    *payload = info & ~(uintptr_t)PAGE_SLAB;
+    return (size <= *payload) ? bp : NULL;
+  }
+
+  current_size = GET_SIZE(HDRP(bp));
+  *payload = current_size - ALLOC_OVERHEAD;
+
+  // a block that has become large belongs in a page run of its own
+  if (size >= LARGE_THRESHOLD)
   {
     return NULL;
   }
 
-  int newsize = ALIGN(size + PAGE_OVERHEAD);
+  new_size = ALIGN(size + ALLOC_OVERHEAD);
+  if (new_size < MIN_BLOCK_SIZE)
+  {
+    new_size = MIN_BLOCK_SIZE;
+  }
+
+  // grow into the next block if it is free and big enough
+  if (new_size > current_size)
+  {
+    next = NEXT_BLKP(bp);
+    if (GET_ALLOC(HDRP(next)) || current_size + GET_SIZE(HDRP(next)) < new_size)
+    {
+      return NULL;
+    }
+    remove_free_block(next);
+    current_size += GET_SIZE(HDRP(next));
+    PUT(HDRP(bp), PACK(current_size, GET_FLAGS(HDRP(bp)) | 1));
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+  }
+
+  // give back the tail if it is big enough to be a block of its own
+  if (current_size - new_size >= MIN_BLOCK_SIZE)
+  {
+    PUT(HDRP(bp), PACK(new_size, GET_FLAGS(HDRP(bp)) | 1));
+    next = NEXT_BLKP(bp);
+    PUT(HDRP(next), PACK(current_size - new_size, PREV_ALLOC | 1));
+    heap->live_blocks++; // heap_free counts it out again
+    heap_free(next);
+  }
+
+  heap->last_block = bp;
+  return bp;
+}
+
+/* Allocate an aligned block of the given size from the heap */
+static void *heap_malloc(size_t size)
+{
+  void *bp;
 
-  // check if there is a page available
-  if (first_pg_chunk == NULL)
+  if (size <= QUICK_MAX && quick_bins[(size - MIN_BLOCK_SIZE) / ALIGNMENT] != NULL)
   {
-    extend(newsize);
+    free_block *fb = quick_bins[(size - MIN_BLOCK_SIZE) / ALIGNMENT];
+    quick_bins[(size - MIN_BLOCK_SIZE) / ALIGNMENT] = fb->next;
+    quick_bytes -= size;
+    quick_blocks--;
+    heap->last_block = fb;
+    return fb;
   }
 
-  // cast the page node pointer to void to get to the first block header
-  page_node *current_pg = first_pg_chunk;
-  while (current_pg != NULL)
+  bp = find_fit(size);
+  if (bp == NULL && quick_bytes > 0)
+  {
+    quick_flush();
+    bp = find_fit(size);
+  }
+  if (bp == NULL)
   {
-    char *block_start = (char *)(current_pg);
-    block_start = block_start + sizeof(page_node) + PADDING + OVERHEAD + sizeof(block_header); // page_node pointers + prolog overhead + block header to payload
-    if (GET_SIZE(HDRP(block_start)) == 4048) {
-      printf("hello moto");
-    } else {
-      printf("test fails");
+    bp = extend(size);
+    if (bp == NULL)
+    {
+      return NULL;
     }
-    exit(1);
   }
 
-  // if (current_avail_size < newsize)-[]
-  // {
-  //   current_avail_size = PAGE_ALIGN(newsize);
-  //   current_avail = mem_map(current_avail_size);
-  //   if (current_avail == NULL)
-  //     return NULL;
-  // }
+  set_allocated(bp, size);
+  heap->live_blocks++;
+  heap->last_block = bp;
+  return bp;
+}
+
+/* Map a dedicated page run for a large object */
+static void *large_malloc(size_t size)
+{
+  size_t run_size = PAGE_ALIGN(size);
+  void *run = map_pages(run_size);
 
-  // p = current_avail;
-  // current_avail += newsize;
-  // current_avail_size -= newsize;
+  if (run == NULL)
+  {
+    return NULL;
+  }
+  large_runs++;
+  large_bytes += run_size;
 
-  // return p;
+  pagemap_set_info(run, run_size | PAGE_LARGE);
+  return run;
 }
 
 /*
- * mm_free - Freeing a block does nothing.
+ * large_free - Unmap ptr's page run if ptr is a large object.
+ *     Returns 0 if ptr is an ordinary block.
  */
-void mm_free(void *ptr)
+static int large_free(void *ptr)
 {
+  uintptr_t info;
+
+  if (!IS_PAGE_ALIGNED(ptr))
+  {
+    return 0;
+  }
+
+  info = page_info(ptr);
+  if (!(info & PAGE_LARGE))
+  {
+    return 0;
+  }
+
+  unmap_pages(ptr, info & ~(uintptr_t)PAGE_LARGE);
+  large_runs--;
+  large_bytes -= info & ~(uintptr_t)PAGE_LARGE;
+  return 1;
+}
+
+/* Return an allocated block to the heap */
+static void heap_free(void *bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+
+  PUT(HDRP(bp), PACK(size, GET_FLAGS(HDRP(bp))));
+  PUT(FTRP(bp), PACK(size, 0));
+  CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+  heap->live_blocks--;
+
+  bp = coalesce(bp);
+  if (IS_WHOLE_CHUNK(bp) && release_chunk(bp))
+  {
+    heap->last_block = NULL;
+    return;
+  }
+  add_free_block(bp);
+  heap->last_block = bp;
+}
+
+/*
+ * quick_free - Park a small block in its quick bin without coalescing it,
+ *     flushing the bins once they hold more than QUICK_LIMIT bytes or
+ *     half of the heap's live blocks.
+ */
+static void quick_free(void *bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+  free_block *fb = (free_block *)(bp);
+
+  if (size > QUICK_MAX)
+  {
+    heap_free(bp);
+  }
+  else
+  {
+    fb->next = quick_bins[(size - MIN_BLOCK_SIZE) / ALIGNMENT];
+    quick_bins[(size - MIN_BLOCK_SIZE) / ALIGNMENT] = fb;
+    quick_bytes += size;
+    quick_blocks++;
+    heap->last_block = bp;
+  }
+
+  if (quick_bytes > QUICK_LIMIT || (quick_blocks > 0 && 2 * quick_blocks >= heap->live_blocks))
+  {
+    quick_flush();
+  }
+}
+
+/* Free and coalesce every block waiting in the quick bins */
+static void quick_flush(void)
+{
+  int bin;
+
+  for (bin = 0; bin < QUICK_BINS; bin++)
+  {
+    while (quick_bins[bin] != NULL)
+    {
+      free_block *fb = quick_bins[bin];
+      quick_bins[bin] = fb->next;
+      heap_free(fb);
+    }
+  }
+  quick_bytes = 0;
+  quick_blocks = 0;
+}
+
+/*
+ * slab_malloc - Take the first free slot of the first partial slab of the
+ *     request's class, starting a new slab if the class has none.
+ */
+static void *slab_malloc(size_t size)
+{
+  int cls = (ALIGN(size) / ALIGNMENT) - 1;
+  slab *sl = partial_slabs[cls];
+  int word, slot;
+
+  if (sl == NULL && (sl = new_slab(cls)) == NULL)
+  {
+    return NULL;
+  }
+  if (sl->free_count == sl->slots)
+  {
+    empty_slab[cls] = 0;
+  }
+
+  for (word = 0; sl->free_map[word] == 0; word++)
+    ;
+  slot = word * 64 + __builtin_ctzll(sl->free_map[word]);
+  sl->free_map[word] &= sl->free_map[word] - 1;
+
+  // a full slab leaves the partial list until one of its blocks is freed
+  if (--sl->free_count == 0)
+  {
+    partial_slabs[cls] = sl->next;
+    if (sl->next != NULL)
+    {
+      sl->next->prev = NULL;
+    }
+  }
+
+  slab_used_bytes += (cls + 1) * ALIGNMENT;
+  return (char *)sl + SLAB_HEADER + (size_t)slot * (cls + 1) * ALIGNMENT;
+}
+
+/*
+ * slab_free - Give ptr's slot back if ptr is a slab block. An empty slab
+ *     is unmapped unless its class has no other empty slab in reserve.
+ *     Returns 0 if ptr is not a slab block.
+ */
+static int slab_free(void *ptr)
+{
+  slab *sl = SLAB_OF(ptr);
+  uintptr_t info = pagemap_get_info(sl);
+  size_t size = info & ~(uintptr_t)PAGE_SLAB;
+  int cls, slot;
+
+  if (!(info & PAGE_SLAB))
+  {
+    return 0;
+  }
+
+  cls = size / ALIGNMENT - 1;
+  slot = ((char *)ptr - (char *)sl - SLAB_HEADER) / size;
+  sl->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+  slab_used_bytes -= size;
+
+  if (sl->free_count++ == 0)
+  {
+    sl->prev = NULL;
+    sl->next = partial_slabs[cls];
+    if (sl->next != NULL)
+    {
+      sl->next->prev = sl;
+    }
+    partial_slabs[cls] = sl;
+  }
+
+  if (sl->free_count == sl->slots)
+  {
+    if (!empty_slab[cls])
+    {
+      empty_slab[cls] = 1;
+      return 1;
+    }
+    if (sl->prev != NULL)
+    {
+      sl->prev->next = sl->next;
+    }
+    else
+    {
+      partial_slabs[cls] = sl->next;
+    }
+    if (sl->next != NULL)
+    {
+      sl->next->prev = sl->prev;
+    }
+    unmap_pages(sl, mem_pagesize());
+    slab_pages--;
+  }
+  return 1;
+}
+
+/* Map a page as a new, empty slab of one class and put it on its list */
+static slab *new_slab(int cls)
+{
+  size_t size = (size_t)(cls + 1) * ALIGNMENT;
+  slab *sl = map_pages(mem_pagesize());
+  int slot;
+
+  if (sl == NULL)
+  {
+    return NULL;
+  }
+
+  sl->slots = (mem_pagesize() - SLAB_HEADER) / size;
+  sl->free_count = sl->slots;
+  memset(sl->free_map, 0, sizeof(sl->free_map));
+  for (slot = 0; slot < sl->slots; slot++)
+  {
+    sl->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+  }
+  pagemap_set_info(sl, size | PAGE_SLAB);
+  slab_pages++;
+
+  sl->prev = NULL;
+  sl->next = NULL;
+  partial_slabs[cls] = sl;
+  empty_slab[cls] = 1;
+  return sl;
+}
+
+/* Flush a thread's cached blocks back to the heap when the thread exits */
+static void tcache_destroy(void *arg)
+{
+  tcache *tc = (tcache *)(arg);
+  int bin;
+
+  if (tc->generation != heap_generation)
+  {
+    return;
+  }
+
+  for (bin = 0; bin < TCACHE_BINS; bin++)
+  {
+    tcache_flush(tc, bin, tc->counts[bin]);
+  }
+}
+
+static void tcache_make_key(void)
+{
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * get_tcache - Return the calling thread's cache, emptying it first if
+ *     mm_init has reset the heap since the cache was last used.
+ */
+static tcache *get_tcache(void)
+{
+  tcache *tc = &thread_cache;
+
+  if (tc->generation != heap_generation)
+  {
+    memset(tc->bins, 0, sizeof(tc->bins));
+    memset(tc->counts, 0, sizeof(tc->counts));
+    tc->generation = heap_generation;
+  }
+
+  if (!tc->registered)
+  {
+    pthread_once(&tcache_key_once, tcache_make_key);
+    pthread_setspecific(tcache_key, tc);
+    tc->registered = 1;
+  }
+
+  return tc;
+}
+
+/*
+ * tcache_refill - Carve a batch of blocks of one size from the heap under
+ *     a single lock acquisition. One block is returned to the caller and
+ *     the rest go into the thread's bin.
+ */
+static void *tcache_refill(tcache *tc, int bin, size_t size)
+{
+  void *first;
+  int i;
+
+  lock_heap();
+  first = heap_malloc(size);
+  for (i = 1; first != NULL && i < TCACHE_BATCH; i++)
+  {
+    free_block *fb = heap_malloc(size);
+    if (fb == NULL)
+    {
+      break;
+    }
+    fb->next = tc->bins[bin];
+    tc->bins[bin] = fb;
+    tc->counts[bin]++;
+  }
+  unlock_heap();
+
+  return first;
+}
+
+/* Return up to count blocks from one bin of a thread cache to the heap */
+static void tcache_flush(tcache *tc, int bin, int count)
+{
+  lock_heap();
+  while (count-- > 0 && tc->bins[bin] != NULL)
+  {
+    free_block *fb = tc->bins[bin];
+    tc->bins[bin] = fb->next;
+    tc->counts[bin]--;
+    heap_free(fb);
+  }
+  unlock_heap();
+}
+
+/*
+ * thread_arena - Return the calling thread's arena, binding the thread to
+ *     the arena of its CPU first if mm_init has run since it last was.
+ */
+static arena *thread_arena(void)
+{
+  int cpu;
+
+  if (heap_bound != heap_generation)
+  {
+    cpu = (thread_cpu >= 0) ? thread_cpu : sched_getcpu();
+    heap = &arenas[(cpu < 0) ? 0 : cpu % num_arenas];
+    heap_bound = heap_generation;
+  }
+  return heap;
+}
+
+/* Take the calling thread's arena lock, freeing what others gave back */
+static void lock_heap(void)
+{
+  pthread_mutex_lock(&thread_arena()->lock);
+  if (__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED) != NULL)
+  {
+    drain_remote_frees();
+  }
+}
+
+static void unlock_heap(void)
+{
+  pthread_mutex_unlock(&heap->lock);
+}
+
+/*
+ * remote_free - Push bp on arena a's stack of remote frees. Only the
+ *     owner ever pops, and it takes the whole stack at once, so a plain
+ *     compare-and-swap push cannot suffer from ABA.
+ */
+static void remote_free(arena *a, void *bp)
+{
+  free_block *fb = (free_block *)(bp);
+
+  fb->next = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&a->remote_frees, &fb->next, fb, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Free the blocks on the remote stack of heap, whose lock is held */
+static void drain_remote_frees(void)
+{
+  free_block *fb = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  free_block *next;
+
+  for (; fb != NULL; fb = next)
+  {
+    next = fb->next;
+    heap_free(fb);
+  }
+}
+
+/*
+ * take_remote_frees - Empty the remote stack of the calling thread's
+ *     arena into its thread cache, flushing bins that reach TCACHE_LIMIT
+ *     as mm_free does, and freeing the blocks too big for the cache under
+ *     the arena lock.
+ */
+static void take_remote_frees(void)
+{
+  free_block *fb = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  free_block *next, *rest = NULL;
+  tcache *tc = get_tcache();
+  size_t size;
+  int bin;
+
+  for (; fb != NULL; fb = next)
+  {
+    next = fb->next;
+    size = GET_SIZE_SHARED(HDRP(fb));
+    if (size > TCACHE_MAX)
+    {
+      fb->next = rest;
+      rest = fb;
+      continue;
+    }
+    bin = (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+    fb->next = tc->bins[bin];
+    tc->bins[bin] = fb;
+    if (++tc->counts[bin] >= TCACHE_LIMIT)
+    {
+      tcache_flush(tc, bin, TCACHE_BATCH);
+    }
+  }
+
+  if (rest != NULL)
+  {
+    lock_heap();
+    for (; rest != NULL; rest = next)
+    {
+      next = rest->next;
+      heap_free(rest);
+    }
+    unlock_heap();
+  }
+}
+
+/*
+ * page_info - The pagemap info of p's page. Other threads may be mapping
+ *     pages at the same time in thread-safe mode, so it peeks without the
+ *     pagemap's lookup cache; p's own page cannot change under it.
+ */
+static uintptr_t page_info(void *p)
+{
+  return threaded ? pagemap_peek_info(p) : pagemap_get_info(p);
+}
+
+static void lock_map(void)
+{
+  if (threaded)
+  {
+    pthread_mutex_lock(&map_lock);
+  }
+}
+
+static void unlock_map(void)
+{
+  if (threaded)
+  {
+    pthread_mutex_unlock(&map_lock);
+  }
+}
+
+/* Map a free block size to its segregated list index */
+static int size_class(size_t size)
+{
+  int cls;
+
+  if (size <= SMALL_MAX)
+  {
+    return (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+  }
+
+  // (512, 1024] -> NUM_EXACT, (1024, 2048] -> NUM_EXACT + 1, ...
+  cls = NUM_EXACT + (63 - __builtin_clzl(size - 1)) - LOG_SMALL_MAX;
+  return (cls < NUM_CLASSES) ? cls : NUM_CLASSES - 1;
+}
+
+/*
+ * find_fit - Take the head of the smallest non-empty exact bin that is big
+ *     enough, or else the best fit from the free tree.
+ */
+static void *find_fit(size_t size)
+{
+  int cls = size_class(size);
+  uint64_t candidates;
+  void *bp, *hot = heap->hot_block;
+
+  if (cls < NUM_EXACT)
+  {
+    candidates = heap->nonempty_classes & (~(uint64_t)0 << cls);
+    if (candidates != 0)
+    {
+      return heap->free_lists[__builtin_ctzll(candidates)];
+    }
+  }
+
+  bp = tree_best_fit(size);
+  if (hot != NULL && GET_SIZE(HDRP(hot)) >= size &&
+      (bp == NULL || GET_SIZE(HDRP(hot)) <= GET_SIZE(HDRP(bp))))
+  {
+    return hot;
+  }
+  return bp;
+}
+
+/*
+ * This function adds a free block to the front of its size class list
+ * using a LIFO Procedure as described in the textbook
+ * page 863, or to the free tree if it is large */
+static void add_free_block(void *bp)
+{
+  int cls;
+  free_block *new_free_block = (free_block *)(bp);
+
+  if (IS_TREE_SIZE(GET_SIZE(HDRP(bp))))
+  {
+    if (heap->hot_block != NULL)
+    {
+      tree_insert((tree_block *)heap->hot_block);
+    }
+    heap->hot_block = bp;
+    return;
+  }
+
+  cls = size_class(GET_SIZE(HDRP(bp)));
+
+  new_free_block->prev = NULL;
+  new_free_block->next = heap->free_lists[cls];
+  if (heap->free_lists[cls] != NULL)
+  {
+    heap->free_lists[cls]->prev = new_free_block;
+  }
+  heap->free_lists[cls] = new_free_block;
+  heap->nonempty_classes |= (uint64_t)1 << cls;
+}
+
+/*
+ * This function removes a free block from its size class list
+ * or from the free tree
+ **/
+static void remove_free_block(void *bp)
+{
+  free_block *fb = (free_block *)(bp);
+
+  if (bp == heap->hot_block)
+  {
+    heap->hot_block = NULL;
+    return;
+  }
+
+  if (IS_TREE_SIZE(GET_SIZE(HDRP(bp))))
+  {
+    tree_remove((tree_block *)bp);
+    return;
+  }
+
+  if (fb->prev != NULL)
+  {
+    fb->prev->next = fb->next;
+  }
+  else
+  {
+    int cls = size_class(GET_SIZE(HDRP(bp)));
+    heap->free_lists[cls] = fb->next;
+    if (fb->next == NULL)
+    {
+      heap->nonempty_classes &= ~((uint64_t)1 << cls);
+    }
+  }
+
+  if (fb->next != NULL)
+  {
+    fb->next->prev = fb->prev;
+  }
+}
+
+/*
+ * tree_before - Does a free block of the given size at address a come
+ *     before free block b in the free tree? Blocks are ordered by size,
+ *     and blocks of equal size by address.
+ */
+static int tree_before(size_t size, void *a, tree_block *b)
+{
+  size_t size_b = GET_SIZE(HDRP(b));
+
+  return size < size_b || (size == size_b && (char *)a < (char *)b);
+}
+
+static int tree_less(tree_block *a, tree_block *b)
+{
+  return tree_before(GET_SIZE(HDRP(a)), a, b);
+}
+
+/*
+ * tree_insert - Descend to where node's priority belongs, then split the
+ *     subtree found there around node's key into its two children.
+ */
+static void tree_insert(tree_block *node)
+{
+  size_t size = GET_SIZE(HDRP(node));
+  tree_block **link = &heap->free_tree, *parent = NULL;
+  tree_block *t, **left, **right, *left_parent, *right_parent;
+
+  while (*link != NULL && TREE_PRIORITY(*link) > TREE_PRIORITY(node))
+  {
+    parent = *link;
+    link = tree_before(size, node, parent) ? &parent->left : &parent->right;
+  }
+
+  t = *link;
+  *link = node;
+  node->parent = parent;
+  left = &node->left;
+  right = &node->right;
+  left_parent = right_parent = node;
+  while (t != NULL)
+  {
+    if (tree_before(size, node, t))
+    {
+      *right = t;
+      t->parent = right_parent;
+      right_parent = t;
+      right = &t->left;
+      t = t->left;
+    }
+    else
+    {
+      *left = t;
+      t->parent = left_parent;
+      left_parent = t;
+      left = &t->right;
+      t = t->right;
+    }
+  }
+  *left = NULL;
+  *right = NULL;
+}
+
+/*
+ * tree_remove - Replace node with the merge of its two subtrees.
+ */
+static void tree_remove(tree_block *node)
+{
+  tree_block *parent = node->parent;
+  tree_block *l = node->left, *r = node->right;
+  tree_block **link;
+
+  if (parent == NULL)
+  {
+    link = &heap->free_tree;
+  }
+  else
+  {
+    link = (parent->left == node) ? &parent->left : &parent->right;
+  }
+
+  // every key in l is smaller than every key in r
+  while (l != NULL && r != NULL)
+  {
+    if (TREE_PRIORITY(l) > TREE_PRIORITY(r))
+    {
+      *link = l;
+      l->parent = parent;
+      parent = l;
+      link = &l->right;
+      l = l->right;
+    }
+    else
+    {
+      *link = r;
+      r->parent = parent;
+      parent = r;
+      link = &r->left;
+      r = r->left;
+    }
+  }
+  *link = (l != NULL) ? l : r;
+  if (*link != NULL)
+  {
+    (*link)->parent = parent;
+  }
+}
+
+/*
+ * tree_best_fit - The smallest free block in the tree that holds size
+ *     bytes, the lowest addressed one among equals, or NULL.
+ */
+static void *tree_best_fit(size_t size)
+{
+  tree_block *t = heap->free_tree, *best = NULL;
+
+  while (t != NULL)
+  {
+    if (GET_SIZE(HDRP(t)) >= size)
+    {
+      best = t;
+      t = t->left;
+    }
+    else
+    {
+      t = t->right;
+    }
+  }
+  return best;
+}
+
+/**
+ * This function follows the textbook practice problem on page
+ * 884 */
+static void set_allocated(void *bp, size_t allocated_size)
+{
+  size_t current_size = GET_SIZE(HDRP(bp));
+  size_t flags = GET_FLAGS(HDRP(bp));
+
+  remove_free_block(bp);
+  if (IS_WHOLE_CHUNK(bp))
+  {
+    heap->empty_chunks--;
+  }
+
+  if ((current_size - allocated_size) >= MIN_BLOCK_SIZE)
+  {
+    PUT(HDRP(bp), PACK(allocated_size, flags | 1));
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(current_size - allocated_size, PREV_ALLOC));
+    PUT(FTRP(bp), PACK(current_size - allocated_size, 0));
+    add_free_block(bp);
+  }
+  else
+  {
+    PUT(HDRP(bp), PACK(current_size, flags | 1));
+    SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+  }
+}
+
+/*
+ * Merge a newly freed block with its free neighbors. The neighbors are
+ * taken off their lists; the caller puts the merged block on its list.
+ * A free block always follows an allocated one, so the merged block's
+ * header keeps PREV_ALLOC set; FIRST_BLOCK comes from whichever block
+ * ends up at the front.
+ */
+static void *coalesce(void *bp)
+{
+  size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+  size_t size = GET_SIZE(HDRP(bp));
+
+  // CASE 1: BOTH ALLOCATED
+  if (prev_alloc && next_alloc)
+  {
+    return bp;
+  }
+
+  // CASE 2: PREVIOUS ALLOCATED and next not allocated
+  else if (prev_alloc && !next_alloc)
+  {
+    remove_free_block(NEXT_BLKP(bp));
+    size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    PUT(HDRP(bp), PACK(size, GET_FLAGS(HDRP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+  }
+
+  // CASE 3: previous not allocated and next allocated
+  else if (!prev_alloc && next_alloc)
+  {
+    remove_free_block(PREV_BLKP(bp));
+    size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+    PUT(FTRP(bp), PACK(size, 0));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, GET_FLAGS(HDRP(PREV_BLKP(bp)))));
+    bp = PREV_BLKP(bp);
+  }
+
+  // CASE 4: both unallocated
+  else
+  {
+    remove_free_block(PREV_BLKP(bp));
+    remove_free_block(NEXT_BLKP(bp));
+    size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    PUT(HDRP(PREV_BLKP(bp)), PACK(size, GET_FLAGS(HDRP(PREV_BLKP(bp)))));
+    PUT(FTRP(PREV_BLKP(bp)), PACK(size, 0));
+    bp = PREV_BLKP(bp);
+  }
+
+  return bp;
+}
+
+static void *extend(size_t new_size)
+{
+  // get a group of contiguous pages from mem_map
+  size_t chunk_size = PAGE_ALIGN(new_size + PAGE_OVERHEAD);
+  void *contig_pgs;
+  void *bp;
+  char *p;
+
+  if (chunk_size < CHUNK_SIZE)
+  {
+    chunk_size = CHUNK_SIZE;
+  }
+
+  lock_map();
+  contig_pgs = map_pages(chunk_size);
+  if (contig_pgs != NULL && threaded)
+  {
+    // name the arena on every page, so that mm_free finds it from any block
+    for (p = contig_pgs; p < (char *)contig_pgs + chunk_size; p += mem_pagesize())
+    {
+      pagemap_set_info(p, ARENA_INFO(heap));
+    }
+  }
+  unlock_map();
+
+  // if mem map returns null then return null
+  if (contig_pgs == NULL)
+  {
+    return NULL;
+  }
+
+  add_pages(contig_pgs); // add the page node to the linked list
+  ((page_node *)contig_pgs)->size = chunk_size;
+
+  // move past the page node
+  contig_pgs = (char *)contig_pgs + sizeof(page_node);
+
+  PUT(contig_pgs, PACK(OVERHEAD, 1));                                                                // Prologue Header
+  PUT((char *)contig_pgs + (1 * WSIZE), PACK(OVERHEAD, 1));                                          // Prologue Footer
+  PUT((char *)contig_pgs + (2 * WSIZE), PACK(chunk_size - PAGE_OVERHEAD, PREV_ALLOC | FIRST_BLOCK)); // Header
+  bp = (char *)contig_pgs + (3 * WSIZE);
+  PUT(FTRP(bp), PACK(chunk_size - PAGE_OVERHEAD, 0)); // Footer
+  PUT(FTRP(bp) + WSIZE, PACK(0, 1));                   // Epilogue Header
+
+  heap->empty_chunks++;
+  add_free_block(bp);
+  return bp;
+}
+
+/* mem_map and mem_unmap, counted for mm_get_stats */
+static void *map_pages(size_t size)
+{
+  void *p = mem_map(size);
+
+  if (p != NULL)
+  {
+    map_calls++;
+    mapped_bytes += size;
+  }
+  return p;
+}
+
+static void *map_pages_at(void *p, size_t size)
+{
+  if (mem_map_at(p, size) == NULL)
+  {
+    return NULL;
+  }
+  map_calls++;
+  mapped_bytes += size;
+  return p;
+}
+
+// give the pages back for good, not just to memlib's run cache
+static void unmap_pages(void *p, size_t size)
+{
+  mem_unmap(p, size);
+  mem_trim();
+  unmap_calls++;
+  unmapped_bytes += size;
+}
+
+// build page linked list
+static void add_pages(void *pg)
+{
+  // cast pg to page node
+  page_node *new_pg_chunk = (page_node *)(pg);
+
+  new_pg_chunk->prev = NULL;
+  new_pg_chunk->next = heap->first_pg_chunk;
+  if (heap->first_pg_chunk != NULL)
+  {
+    heap->first_pg_chunk->prev = new_pg_chunk;
+  }
+  heap->first_pg_chunk = new_pg_chunk;
+}
+
+// unlink a chunk from the page linked list
+static void remove_pages(page_node *pg)
+{
+  if (pg->prev != NULL)
+  {
+    pg->prev->next = pg->next;
+  }
+  else
+  {
+    heap->first_pg_chunk = pg->next;
+  }
+
+  if (pg->next != NULL)
+  {
+    pg->next->prev = pg->prev;
+  }
+}
+
+/*
+ * release_chunk - Called with a free block that spans its whole chunk.
+ *     Keeps up to KEEP_EMPTY_CHUNKS standard-size chunks in reserve and
+ *     unmaps the chunk otherwise. Returns 1 if the chunk was unmapped.
+ */
+static int release_chunk(void *bp)
+{
+  page_node *pg = CHUNKP(bp);
+
+  if (pg->size <= CHUNK_SIZE && heap->empty_chunks < KEEP_EMPTY_CHUNKS)
+  {
+    heap->empty_chunks++;
+    return 0;
+  }
+
+  remove_pages(pg);
+  lock_map();
+  unmap_pages(pg, pg->size);
+  unlock_map();
+  return 1;
+}
+
+/*
+ * mm_get_stats - Describe the heap: what it holds, how its free space is
+ *     spread over the size classes, and how often it has mapped and
+ *     unmapped pages since mm_init. Walks every chunk, so it costs time
+ *     proportional to the heap. Blocks sitting in thread caches, quick
+ *     bins or on remote free stacks count as in use.
+ */
+void mm_get_stats(mm_stats_t *st)
+{
+  arena *own = heap;
+  page_node *pg;
+  void *bp;
+  size_t size;
+  int cls;
+
+  memset(st, 0, sizeof(*st));
+  for (heap = arenas; heap < arenas + num_arenas; heap++)
+  {
+    if (threaded)
+    {
+      pthread_mutex_lock(&heap->lock);
+    }
+    for (pg = heap->first_pg_chunk; pg != NULL; pg = pg->next)
+    {
+      st->chunks++;
+      st->chunk_bytes += pg->size;
+      for (bp = (char *)pg + PAGE_OVERHEAD; (size = GET_SIZE(HDRP(bp))) != 0; bp = NEXT_BLKP(bp))
+      {
+        if (GET_ALLOC(HDRP(bp)))
+        {
+          st->in_use_bytes += size;
+          continue;
+        }
+        cls = size_class(size);
+        st->free_bytes += size;
+        st->class_free_bytes[cls] += size;
+        st->class_free_blocks[cls]++;
+        if (size > st->largest_free)
+        {
+          st->largest_free = size;
+        }
+      }
+    }
+    st->empty_chunks += heap->empty_chunks;
+    if (threaded)
+    {
+      pthread_mutex_unlock(&heap->lock);
+    }
+  }
+  heap = own;
+
+  if (threaded)
+  {
+    pthread_mutex_lock(&map_lock);
+  }
+
+  for (cls = 0; cls < NUM_CLASSES; cls++)
+  {
+    st->class_limit[cls] = (cls < NUM_EXACT) ? MIN_BLOCK_SIZE + (size_t)cls * ALIGNMENT
+                                             : (size_t)SMALL_MAX << (cls - NUM_EXACT + 1);
+  }
+  st->class_limit[NUM_CLASSES - 1] = SIZE_MAX;
+
+  st->quick_bytes = quick_bytes;
+  st->slab_pages = slab_pages;
+  st->slab_bytes = (size_t)slab_pages * mem_pagesize();
+  st->in_use_bytes += slab_used_bytes;
+  st->large_runs = large_runs;
+  st->large_bytes = large_bytes;
+  st->in_use_bytes += large_bytes;
+  st->heap_bytes = st->chunk_bytes + st->slab_bytes + st->large_bytes;
+  st->map_calls = map_calls;
+  st->unmap_calls = unmap_calls;
+  st->mapped_bytes = mapped_bytes;
+  st->unmapped_bytes = unmapped_bytes;
+
+  if (threaded)
+  {
+    pthread_mutex_unlock(&map_lock);
+  }
+}
+
+/*
+ * mm_check - Check the heap invariants and report the first violation
+ *     on stderr. With deep == 0 only the block touched by the last heap
+ *     operation, its neighbors and the free list heads are checked, in
+ *     constant time apart from looking large free blocks up in the tree.
+ *     With deep != 0 every chunk, free list and the tree are walked.
+ *     Returns nonzero if and only if the heap is consistent.
+ */
+int mm_check(int deep)
+{
+  arena *own = heap;
+  int ok = 1;
+
+  for (heap = arenas; ok && heap < arenas + num_arenas; heap++)
+  {
+    if (threaded)
+    {
+      pthread_mutex_lock(&heap->lock);
+    }
+    ok = check_arena(deep);
+    if (threaded)
+    {
+      pthread_mutex_unlock(&heap->lock);
+    }
+  }
+  heap = own;
+
+  if (ok && deep)
+  {
+    ok = check_slabs();
+  }
+  if (ok && deep)
+  {
+    ok = check_quick();
+  }
+  return ok;
+}
+
+/* check_arena - mm_check for heap, the arena being checked */
+static int check_arena(int deep)
+{
+  page_node *pg;
+  int ok = 1, free_blocks = 0;
+  int cls;
+
+  for (cls = 0; ok && cls < NUM_CLASSES; cls++)
+  {
+    if ((heap->free_lists[cls] != NULL) != ((heap->nonempty_classes >> cls) & 1))
+    {
+      fprintf(stderr, "mm_check: class %d: nonempty bit is wrong\n", cls);
+      ok = 0;
+    }
+    else if (heap->free_lists[cls] != NULL && heap->free_lists[cls]->prev != NULL)
+    {
+      fprintf(stderr, "mm_check: class %d: head has a prev link\n", cls);
+      ok = 0;
+    }
+  }
+
+  if (!deep)
+  {
+    if (ok && heap->last_block != NULL)
+    {
+      ok = check_block(heap->last_block);
+      if (ok && !GET_PREV_ALLOC(HDRP(heap->last_block)))
+      {
+        ok = check_block(PREV_BLKP(heap->last_block));
+      }
+      if (ok && GET_SIZE(HDRP(NEXT_BLKP(heap->last_block))) != 0)
+      {
+        ok = check_block(NEXT_BLKP(heap->last_block));
+      }
+    }
+  }
+  else
+  {
+    for (pg = heap->first_pg_chunk; ok && pg != NULL; pg = pg->next)
+    {
+      ok = check_chunk(pg, &free_blocks);
+    }
+    if (ok)
+    {
+      ok = check_lists(free_blocks);
+    }
+  }
+  return ok;
+}
+
+static int check_error(void *p, const char *msg)
+{
+  fprintf(stderr, "mm_check: %p: %s\n", p, msg);
+  return 0;
+}
+
+/*
+ * check_block - Check one block against its header, footer, neighbors
+ *     and, if it is free, its free list links or its place in the tree.
+ */
+static int check_block(void *bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+  free_block *fb = (free_block *)(bp);
+  tree_block *t;
+  int cls;
+
+  if ((uintptr_t)bp % ALIGNMENT != 0)
+  {
+    return check_error(bp, "payload is misaligned");
+  }
+  if (size < MIN_BLOCK_SIZE)
+  {
+    return check_error(bp, "block is smaller than the minimum");
+  }
+  if ((GET(HDRP(bp)) & FIRST_BLOCK) && GET(HDRP(bp) - WSIZE) != PACK(OVERHEAD, 1))
+  {
+    return check_error(bp, "first block does not follow a prologue");
+  }
+  if (!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp)))
+  {
+    return check_error(bp, "next block's PREV_ALLOC bit is wrong");
+  }
+
+  if (GET_ALLOC(HDRP(bp)))
+  {
+    return 1;
+  }
+
+  if (GET(FTRP(bp)) != PACK(size, 0))
+  {
+    return check_error(bp, "footer does not match header");
+  }
+  if (!GET_PREV_ALLOC(HDRP(bp)) || !GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+  {
+    return check_error(bp, "free block has a free neighbor");
+  }
+
+  if (bp == heap->hot_block)
+  {
+    return 1;
+  }
+
+  if (IS_TREE_SIZE(size))
+  {
+    for (t = (tree_block *)bp; t->parent != NULL; t = t->parent)
+    {
+      if (t->parent->left != t && t->parent->right != t)
+      {
+        return check_error(t, "free tree parent link is broken");
+      }
+    }
+    return t == heap->free_tree ? 1 : check_error(bp, "free block is not in the free tree");
+  }
+
+  cls = size_class(size);
+  if (fb->prev != NULL ? fb->prev->next != fb : heap->free_lists[cls] != fb)
+  {
+    return check_error(bp, "free block is not linked from its list");
+  }
+  if (fb->next != NULL && fb->next->prev != fb)
+  {
+    return check_error(bp, "free block's next link is broken");
+  }
+  return 1;
+}
+
+/*
+ * check_chunk - Check a chunk's pages, prologue and epilogue, and every
+ *     block in it. Adds the number of free blocks seen to *free_blocks.
+ */
+static int check_chunk(page_node *pg, int *free_blocks)
+{
+  char *end = (char *)pg + pg->size;
+  char *p;
+  void *bp;
+  int empty = 0;
+
+  if (pg->next != NULL && pg->next->prev != pg)
+  {
+    return check_error(pg, "chunk list is broken");
+  }
+  if (pg->size < CHUNK_SIZE || PAGE_ALIGN(pg->size) != pg->size)
+  {
+    return check_error(pg, "chunk size is not a page multiple");
+  }
+  // pagemap_is_mapped goes through the pagemap's lookup cache, which
+  // other threads change under map_lock
+  lock_map();
+  for (p = (char *)pg; p < end && pagemap_is_mapped(p); p += mem_pagesize())
+    ;
+  unlock_map();
+  if (p < end)
+  {
+    return check_error(p, "chunk page is not in the pagemap");
+  }
+  if (page_info(pg) & PAGE_LARGE)
+  {
+    return check_error(pg, "chunk is tagged as a large object");
+  }
+  for (p = (char *)pg; threaded && p < end; p += mem_pagesize())
+  {
+    if (page_info(p) != ARENA_INFO(heap))
+    {
+      return check_error(p, "chunk page is not tagged with its arena");
+    }
+  }
+
+  bp = (char *)pg + PAGE_OVERHEAD;
+  if (!(GET(HDRP(bp)) & FIRST_BLOCK) || !GET_PREV_ALLOC(HDRP(bp)))
+  {
+    return check_error(bp, "first block lacks FIRST_BLOCK or PREV_ALLOC");
+  }
+
+  for (; GET_SIZE(HDRP(bp)) != 0; bp = NEXT_BLKP(bp))
+  {
+    if (GET_SIZE(HDRP(bp)) < MIN_BLOCK_SIZE || (char *)NEXT_BLKP(bp) > end)
+    {
+      return check_error(bp, "block size runs past the chunk");
+    }
+    if (bp != (char *)pg + PAGE_OVERHEAD && (GET(HDRP(bp)) & FIRST_BLOCK))
+    {
+      return check_error(bp, "FIRST_BLOCK set inside a chunk");
+    }
+    if (!check_block(bp))
+    {
+      return 0;
+    }
+    if (!GET_ALLOC(HDRP(bp)))
+    {
+      (*free_blocks)++;
+      empty += IS_WHOLE_CHUNK(bp);
+    }
+  }
+
+  if (HDRP(bp) != end - WSIZE || !GET_ALLOC(HDRP(bp)))
+  {
+    return check_error(bp, "epilogue is not at the end of the chunk");
+  }
+  if (empty && pg->size > CHUNK_SIZE)
+  {
+    return check_error(pg, "oversized chunk left empty");
+  }
+  return 1;
+}
+
+/*
+ * check_lists - Walk every free list, the free tree and the hot block,
+ *     checking that each member is a free block of the right class and
+ *     that together they hold exactly the free_blocks free blocks found in
+ *     the chunks.
+ */
+static int check_lists(int free_blocks)
+{
+  free_block *fb;
+  int cls, listed = 0, empty = 0;
+
+  for (cls = 0; cls < NUM_CLASSES; cls++)
+  {
+    for (fb = heap->free_lists[cls]; fb != NULL; fb = fb->next)
+    {
+      if (++listed > free_blocks)
+      {
+        return check_error(fb, "free lists hold more blocks than the heap");
+      }
+      if (GET_ALLOC(HDRP(fb)))
+      {
+        return check_error(fb, "allocated block on a free list");
+      }
+      if (size_class(GET_SIZE(HDRP(fb))) != cls)
+      {
+        return check_error(fb, "free block is on the wrong list");
+      }
+      if (fb->next != NULL && fb->next->prev != fb)
+      {
+        return check_error(fb, "free list links are broken");
+      }
+      empty += IS_WHOLE_CHUNK(fb);
+    }
+  }
+
+  if (heap->free_tree != NULL && heap->free_tree->parent != NULL)
+  {
+    return check_error(heap->free_tree, "free tree root has a parent");
+  }
+  if (!check_tree(heap->free_tree, NULL, NULL, &listed, &empty))
+  {
+    return 0;
+  }
+  if (heap->hot_block != NULL)
+  {
+    if (GET_ALLOC(HDRP(heap->hot_block)) || !IS_TREE_SIZE(GET_SIZE(HDRP(heap->hot_block))))
+    {
+      return check_error(heap->hot_block, "hot block is not a free block of tree size");
+    }
+    listed++;
+    empty += IS_WHOLE_CHUNK(heap->hot_block);
+  }
+  if (listed != free_blocks)
+  {
+    return check_error(NULL, "free block missing from the free lists");
+  }
+  if (empty != heap->empty_chunks)
+  {
+    return check_error(NULL, "empty chunk count is wrong");
+  }
+  return 1;
+}
+
+/*
+ * check_tree - Check the subtree rooted at t, whose keys must lie strictly
+ *     between lo and hi (NULL for no bound): every node a large free block
+ *     linked back to by its children, with no higher priority than its
+ *     parent. Adds its blocks to *count and the ones that span a whole
+ *     chunk to *empty.
+ */
+static int check_tree(tree_block *t, tree_block *lo, tree_block *hi, int *count, int *empty)
+{
+  for (; t != NULL; hi = t, t = t->left)
+  {
+    if (GET_ALLOC(HDRP(t)))
+    {
+      return check_error(t, "allocated block in the free tree");
+    }
+    if (!IS_TREE_SIZE(GET_SIZE(HDRP(t))))
+    {
+      return check_error(t, "small block in the free tree");
+    }
+    if ((lo != NULL && !tree_less(lo, t)) || (hi != NULL && !tree_less(t, hi)))
+    {
+      return check_error(t, "free tree is out of order");
+    }
+    if ((t->left != NULL && TREE_PRIORITY(t->left) > TREE_PRIORITY(t)) ||
+        (t->right != NULL && TREE_PRIORITY(t->right) > TREE_PRIORITY(t)))
+    {
+      return check_error(t, "free tree priorities are out of order");
+    }
+    if ((t->left != NULL && t->left->parent != t) ||
+        (t->right != NULL && t->right->parent != t))
+    {
+      return check_error(t, "free tree parent link is broken");
+    }
+    (*count)++;
+    *empty += IS_WHOLE_CHUNK(t);
+    if (!check_tree(t->right, t, hi, count, empty))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * check_quick - Check that every block in a quick bin is an allocated
+ *     block of the bin's size and that the bins add up to quick_bytes
+ *     and quick_blocks.
+ */
+static int check_quick(void)
+{
+  free_block *fb;
+  size_t bytes = 0;
+  int blocks = 0;
+  int bin;
+
+  for (bin = 0; bin < QUICK_BINS; bin++)
+  {
+    for (fb = quick_bins[bin]; fb != NULL; fb = fb->next)
+    {
+      if (!GET_ALLOC(HDRP(fb)))
+      {
+        return check_error(fb, "free block in a quick bin");
+      }
+      if (GET_SIZE(HDRP(fb)) != MIN_BLOCK_SIZE + (size_t)bin * ALIGNMENT)
+      {
+        return check_error(fb, "block is in the wrong quick bin");
+      }
+      blocks++;
+      if ((bytes += GET_SIZE(HDRP(fb))) > quick_bytes)
+      {
+        return check_error(fb, "quick bins hold more than quick_bytes");
+      }
+    }
+  }
+  if (bytes != quick_bytes)
+  {
+    return check_error(NULL, "quick_bytes is wrong");
+  }
+  if (blocks != quick_blocks)
+  {
+    return check_error(NULL, "quick_blocks is wrong");
+  }
+  return 1;
+}
+
+/*
+ * check_slabs - Check that every slab on a partial list is tagged for its
+ *     class in the pagemap and that its free count matches its bitmap.
+ */
+static int check_slabs(void)
+{
+  slab *sl;
+  int cls, i, free_slots;
+
+  for (cls = 0; cls < SLAB_CLASSES; cls++)
+  {
+    for (sl = partial_slabs[cls]; sl != NULL; sl = sl->next)
+    {
+      if (pagemap_get_info(sl) != (((uintptr_t)(cls + 1) * ALIGNMENT) | PAGE_SLAB))
+      {
+        return check_error(sl, "slab page is not tagged for its class");
+      }
+      if (sl->next != NULL && sl->next->prev != sl)
+      {
+        return check_error(sl, "slab list links are broken");
+      }
+      for (i = 0, free_slots = 0; i < 4; i++)
+      {
+        free_slots += __builtin_popcountll(sl->free_map[i]);
+      }
+      if (free_slots != sl->free_count || free_slots == 0 || free_slots > sl->slots)
+      {
+        return check_error(sl, "slab free count does not match its bitmap");
+      }
+    }
+  }
+  return 1;
 }
@@ -3,3 +3,37 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void *mm_realloc (void *ptr, size_t size);
+extern void mm_set_threaded (int on);
+extern void mm_set_deferred (int on);
+extern void mm_set_arenas (int n);
+extern void mm_bind_arena (int cpu);
+extern int mm_check (int deep);
+
+/* Number of segregated free list classes reported by mm_get_stats */
+#define MM_STATS_CLASSES 64
+
+/* A snapshot of the heap, filled in by mm_get_stats */
+typedef struct {
+    size_t heap_bytes;        /* chunk_bytes + slab_bytes + large_bytes */
+    size_t in_use_bytes;      /* allocated blocks, slab slots and large runs */
+    size_t free_bytes;        /* free blocks in the chunks */
+    size_t largest_free;      /* largest free block */
+    size_t quick_bytes;       /* freed blocks awaiting coalescing (in use) */
+    size_t class_free_bytes[MM_STATS_CLASSES];  /* free bytes per class... */
+    size_t class_free_blocks[MM_STATS_CLASSES]; /* ... and free blocks */
+    size_t class_limit[MM_STATS_CLASSES];       /* largest block size in class */
+    int chunks;               /* page chunks holding ordinary blocks */
+    int empty_chunks;         /* chunks kept mapped while empty */
+    size_t chunk_bytes;
+    int slab_pages;           /* pages holding tiny blocks */
+    size_t slab_bytes;
+    int large_runs;           /* page runs holding one large block each */
+    size_t large_bytes;
+    unsigned long map_calls;  /* mem_map calls since mm_init */
+    unsigned long unmap_calls;/* mem_unmap calls since mm_init */
+    size_t mapped_bytes;
+    size_t unmapped_bytes;
+} mm_stats_t;
+
+extern void mm_get_stats (mm_stats_t *st);
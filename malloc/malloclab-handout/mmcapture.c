@@ -0,0 +1,379 @@
+/*
+ * mmcapture.c - LD_PRELOAD shim that records a process's heap requests
+ *
+ * usage: MMCAPTURE_FILE=app.cap LD_PRELOAD=./libmmcapture.so <program>
+ *        capture2bin app.cap app.bin
+ *
+ * Every malloc, calloc, realloc, free, posix_memalign, aligned_alloc
+ * and memalign is passed on to the real allocator and logged as a
+ * capture_rec (see tracefmt.h). Records go into a buffer owned by the
+ * calling thread, so the only shared state touched per call is the
+ * atomic sequence counter; a full buffer is written out with a single
+ * pwrite() at an atomically reserved file offset. Buffers of exiting
+ * threads are flushed by a thread-specific-data destructor, the rest
+ * at process exit.
+ *
+ * Sequence numbers are taken before a block is released and after a
+ * block is obtained, so a free always sorts ahead of any call that
+ * gets the same address back. Alignment requests are recorded as
+ * plain allocations. Children created by fork() are not captured.
+ *
+ * If MMCAPTURE_FILE is unset the capture goes to mmcapture.<pid>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "tracefmt.h"
+
+#define CAPTURE_BUF_RECS 8192   /* records per thread buffer */
+#define BOOTSTRAP_SIZE (16 * 1024)
+
+/* A thread's record buffer; mmap'ed so that it never re-enters malloc */
+typedef struct capture_buf {
+    struct capture_buf *next;   /* list of all live buffers */
+    uint32_t thread;            /* thread number stamped on records */
+    int count;                  /* records waiting in recs[] */
+    capture_rec recs[CAPTURE_BUF_RECS];
+} capture_buf;
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+
+static int capture_fd = -1;     /* -1 when not capturing */
+static uint64_t next_seq;       /* global order of calls */
+static off_t file_end;          /* end of the reserved part of the file */
+static uint32_t next_thread;
+static capture_buf *all_bufs;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buf_key;
+
+/* initial-exec keeps TLS access from calling into malloc */
+static __thread capture_buf *my_buf __attribute__((tls_model("initial-exec")));
+static __thread int in_capture __attribute__((tls_model("initial-exec")));
+
+/* dlsym() may allocate before the real functions are known */
+static int resolving;
+static char bootstrap_heap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+
+static void capture_init(void);
+static void capture_fini(void);
+
+/*****************
+ * Capture buffers
+ *****************/
+
+/* flush_buf - write a buffer's records out and empty it */
+static void flush_buf(capture_buf *b)
+{
+    size_t len = b->count * sizeof(capture_rec);
+    char *p = (char *)b->recs;
+    off_t off;
+    ssize_t n;
+
+    if (b->count == 0 || capture_fd < 0)
+        return;
+    off = __atomic_fetch_add(&file_end, (off_t)len, __ATOMIC_RELAXED);
+    while (len > 0) {
+        if ((n = pwrite(capture_fd, p, len, off)) <= 0)
+            break;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    b->count = 0;
+}
+
+/* new_buf - give the calling thread its buffer */
+static capture_buf *new_buf(void)
+{
+    capture_buf *b;
+
+    b = mmap(NULL, sizeof(capture_buf), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+        return NULL;
+    b->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+    b->count = 0;
+
+    pthread_mutex_lock(&bufs_lock);
+    b->next = all_bufs;
+    all_bufs = b;
+    pthread_mutex_unlock(&bufs_lock);
+
+    my_buf = b;
+    pthread_setspecific(buf_key, b);
+    return b;
+}
+
+/* thread_exit - flush and drop an exiting thread's buffer */
+static void thread_exit(void *arg)
+{
+    capture_buf *b = arg, **pp;
+
+    in_capture = 1;
+    pthread_mutex_lock(&bufs_lock);
+    for (pp = &all_bufs; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == b) {
+            *pp = b->next;
+            break;
+        }
+    }
+    flush_buf(b);
+    pthread_mutex_unlock(&bufs_lock);
+    my_buf = NULL;
+    munmap(b, sizeof(capture_buf));
+    in_capture = 0;
+}
+
+/* record - log one call in the calling thread's buffer */
+static void record(uint32_t type, void *ptr, size_t size, uint64_t seq)
+{
+    capture_buf *b;
+    capture_rec *r;
+
+    if ((b = my_buf) == NULL && (b = new_buf()) == NULL)
+        return;
+    r = &b->recs[b->count++];
+    r->seq = seq;
+    r->ptr = (uintptr_t)ptr;
+    r->size = size;
+    r->type = type;
+    r->thread = b->thread;
+    if (b->count == CAPTURE_BUF_RECS)
+        flush_buf(b);
+}
+
+static uint64_t take_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+}
+
+/* capturing - true if this call should be logged; enters the shim */
+static int capturing(void)
+{
+    if (capture_fd < 0 || in_capture)
+        return 0;
+    in_capture = 1;
+    return 1;
+}
+
+static void record_alloc(void *ptr, size_t size)
+{
+    if (ptr != NULL && capturing()) {
+        record(CAPTURE_ALLOC, ptr, size, take_seq());
+        in_capture = 0;
+    }
+}
+
+/****************
+ * Setup/teardown
+ ****************/
+
+static void *bootstrap_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > BOOTSTRAP_SIZE)
+        return NULL;
+    p = bootstrap_heap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int is_bootstrap(void *ptr)
+{
+    return (char *)ptr >= bootstrap_heap &&
+        (char *)ptr < bootstrap_heap + BOOTSTRAP_SIZE;
+}
+
+/* stop_in_child - a forked child would interleave with the parent */
+static void stop_in_child(void)
+{
+    capture_fd = -1;
+}
+
+__attribute__((constructor))
+static void capture_init(void)
+{
+    char path[256], *env;
+    char magic[CAPTURE_MAGIC_LEN];
+    int fd;
+
+    if (real_malloc != NULL || resolving)
+        return;
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    resolving = 0;
+    if (real_malloc == NULL || real_free == NULL || real_calloc == NULL ||
+        real_realloc == NULL) {
+        fprintf(stderr, "mmcapture: cannot find the real allocator\n");
+        abort();
+    }
+
+    if ((env = getenv("MMCAPTURE_FILE")) != NULL)
+        snprintf(path, sizeof(path), "%s", env);
+    else
+        snprintf(path, sizeof(path), "mmcapture.%d", (int)getpid());
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "mmcapture: cannot create %s\n", path);
+        return;
+    }
+    memcpy(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    if (write(fd, magic, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN) {
+        close(fd);
+        return;
+    }
+    file_end = CAPTURE_MAGIC_LEN;
+
+    pthread_key_create(&buf_key, thread_exit);
+    pthread_atfork(NULL, NULL, stop_in_child);
+    capture_fd = fd;
+}
+
+__attribute__((destructor))
+static void capture_fini(void)
+{
+    capture_buf *b;
+    int fd = capture_fd;
+
+    if (fd < 0)
+        return;
+    in_capture = 1;
+    pthread_mutex_lock(&bufs_lock);
+    for (b = all_bufs; b != NULL; b = b->next)
+        flush_buf(b);
+    capture_fd = -1;
+    pthread_mutex_unlock(&bufs_lock);
+    close(fd);
+}
+
+/**************************
+ * The interposed functions
+ **************************/
+
+void *malloc(size_t size)
+{
+    void *p;
+
+    if (real_malloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(size);
+        capture_init();
+    }
+    p = real_malloc(size);
+    record_alloc(p, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (real_calloc == NULL) {
+        /* the bootstrap heap is static, hence already zeroed */
+        if (resolving)
+            return (size != 0 && nmemb > BOOTSTRAP_SIZE / size) ?
+                NULL : bootstrap_alloc(nmemb * size);
+        capture_init();
+    }
+    p = real_calloc(nmemb, size);
+    record_alloc(p, nmemb * size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || is_bootstrap(ptr))
+        return;
+    if (real_free == NULL)
+        capture_init();
+    if (capturing()) {
+        record(CAPTURE_FREE, ptr, 0, take_seq());
+        in_capture = 0;
+    }
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (real_realloc == NULL)
+        capture_init();
+    if (ptr == NULL)
+        return malloc(size);
+    if (is_bootstrap(ptr)) {
+        /* never freed, so copying too much is harmless */
+        if ((p = malloc(size)) != NULL)
+            memcpy(p, ptr, size < BOOTSTRAP_SIZE ? size : BOOTSTRAP_SIZE);
+        return p;
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (!capturing())
+        return real_realloc(ptr, size);
+    record(CAPTURE_REALLOC_BEGIN, ptr, 0, take_seq());
+    in_capture = 0;
+    p = real_realloc(ptr, size);
+    in_capture = 1;
+    record(CAPTURE_REALLOC_END, p, size, take_seq());
+    in_capture = 0;
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int ret;
+
+    if (real_posix_memalign == NULL)
+        capture_init();
+    ret = real_posix_memalign(memptr, alignment, size);
+    if (ret == 0)
+        record_alloc(*memptr, size);
+    return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *p;
+
+    if (real_aligned_alloc == NULL)
+        capture_init();
+    p = real_aligned_alloc(alignment, size);
+    record_alloc(p, size);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p;
+
+    if (real_memalign == NULL)
+        capture_init();
+    p = real_memalign(alignment, size);
+    record_alloc(p, size);
+    return p;
+}
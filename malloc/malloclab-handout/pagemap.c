@@ -3,17 +3,13 @@
 #include <inttypes.h>
 #include "pagemap.h"
 
-/* Keep track of all mapped pages so that we can easily get a list of
-   all of them --- but also efficiently add and remove from the list. */
-
-typedef struct mpage {
-  void *addr;
-  struct mpage *prev, *next;
-} mpage;
-
-static mpage *all_mapped_pages;
-
-static mpage ***page_maps1;
+/* Keep track of all mapped pages in a three-level radix tree. The
+   leaves cover 4GB each and are dense bitmaps, one bit per page, so
+   a leaf costs 128KB instead of a 32-byte record per page. Per-page
+   info lives in separately allocated groups of INFO_GROUP_PAGES
+   entries, created only when an owner first sets info in that range.
+   The leaves with any mapped page are chained together so that
+   pagemap_for_each can scan their bitmaps. */
 
 #define PAGEMAP64_LEVEL1_SIZE (1 << 16)
 #define PAGEMAP64_LEVEL2_SIZE (1 << 16)
@@ -21,81 +17,302 @@ static mpage ***page_maps1;
 #define PAGEMAP64_LEVEL1_BITS(p) (((uintptr_t)(p)) >> 48)
 #define PAGEMAP64_LEVEL2_BITS(p) ((((uintptr_t)(p)) >> 32) & ((PAGEMAP64_LEVEL2_SIZE) - 1))
 #define PAGEMAP64_LEVEL3_BITS(p) ((((uintptr_t)(p)) >> LOG_APAGE_SIZE) & ((PAGEMAP64_LEVEL3_SIZE) - 1))
+#define PAGEMAP64_LEAF_KEY(p) (((uintptr_t)(p)) >> 32)
 
-void pagemap_modify(void *p, int mapped) {
+#define BITMAP_WORDS (PAGEMAP64_LEVEL3_SIZE / 64)
+#define INFO_GROUP_PAGES 512
+#define INFO_GROUPS (PAGEMAP64_LEVEL3_SIZE / INFO_GROUP_PAGES)
+
+typedef struct leaf {
+  uint64_t bits[BITMAP_WORDS];   /* one bit per mapped page */
+  uintptr_t *info[INFO_GROUPS];  /* owner-defined page metadata, or NULL */
+  uintptr_t base;                /* address of the leaf's first page */
+  size_t count;                  /* pages mapped in this leaf */
+  struct leaf *next_used;        /* chain of leaves with count > 0 */
+  int on_chain;
+} leaf;
+
+static leaf ***page_maps1;
+static leaf *used_leaves;
+
+/* The leaf found by the last lookup; nearly every lookup hits it */
+static leaf *last_leaf;
+static uintptr_t last_key;
+
+static pagemap_usage usage;
+
+static void *pagemap_calloc(size_t n, size_t size, size_t *counter) {
+  void *p = calloc(n, size);
+
+  if (!p) {
+    fprintf(stderr, "internal error: out of memory for the pagemap\n");
+    abort();
+  }
+  *counter += n * size;
+  return p;
+}
+
+/* find_leaf - the leaf covering p, created if create is set, or NULL */
+static leaf *find_leaf(void *p, int create) {
+  leaf **page_maps2;
+  leaf *page_maps3;
   uintptr_t pos;
-  mpage **page_maps2;
-  mpage *page_maps3;
-  mpage *page;
+
+  if (last_leaf && PAGEMAP64_LEAF_KEY(p) == last_key)
+    return last_leaf;
 
   if (!page_maps1) {
-    page_maps1 = calloc(PAGEMAP64_LEVEL1_SIZE, sizeof(mpage **));
+    if (!create) return NULL;
+    page_maps1 = pagemap_calloc(PAGEMAP64_LEVEL1_SIZE, sizeof(leaf **),
+                                &usage.tables);
   }
 
   pos = PAGEMAP64_LEVEL1_BITS(p);
   page_maps2 = page_maps1[pos];
   if (!page_maps2) {
-    page_maps2 = calloc(PAGEMAP64_LEVEL2_SIZE, sizeof(mpage *));
+    if (!create) return NULL;
+    page_maps2 = pagemap_calloc(PAGEMAP64_LEVEL2_SIZE, sizeof(leaf *),
+                                &usage.tables);
     page_maps1[pos] = page_maps2;
   }
-  
+
   pos = PAGEMAP64_LEVEL2_BITS(p);
   page_maps3 = page_maps2[pos];
   if (!page_maps3) {
-    page_maps3 = calloc(PAGEMAP64_LEVEL3_SIZE, sizeof(mpage));
+    if (!create) return NULL;
+    page_maps3 = pagemap_calloc(1, sizeof(leaf), &usage.bitmaps);
+    /* The leaf's array of info group pointers is info, not bitmap */
+    usage.bitmaps -= sizeof(page_maps3->info);
+    usage.info += sizeof(page_maps3->info);
+    page_maps3->base = PAGEMAP64_LEAF_KEY(p) << 32;
     page_maps2[pos] = page_maps3;
   }
 
-  page = &page_maps3[PAGEMAP64_LEVEL3_BITS(p)];
+  last_leaf = page_maps3;
+  last_key = PAGEMAP64_LEAF_KEY(p);
+  return page_maps3;
+}
+
+#define TEST_BIT(l, i) (((l)->bits[(i) >> 6] >> ((i) & 63)) & 1)
+
+/* Bitmap words are only changed under the caller's lock, but
+   pagemap_peek_info reads them without it, so the changes are stored
+   atomically */
+#define SET_BITS(l, w, v) __atomic_store_n(&(l)->bits[w], (v), __ATOMIC_RELAXED)
+
+static void clear_info(leaf *l, uintptr_t i) {
+  if (l->info[i / INFO_GROUP_PAGES])
+    l->info[i / INFO_GROUP_PAGES][i % INFO_GROUP_PAGES] = 0;
+}
+
+void pagemap_modify(void *p, int mapped) {
+  leaf *l = find_leaf(p, 1);
+  uintptr_t i = PAGEMAP64_LEVEL3_BITS(p);
 
   if (mapped) {
-    if (page->addr) {
+    if (TEST_BIT(l, i)) {
       fprintf(stderr, "internal error: page is already mapped\n");
       abort();
     }
-    if (page == all_mapped_pages)
-      abort();
-    page->addr = p;
-    page->prev = NULL;
-    page->next = all_mapped_pages;
-    if (all_mapped_pages)
-      all_mapped_pages->prev = page;
-    all_mapped_pages = page;
+    SET_BITS(l, i >> 6, l->bits[i >> 6] | (uint64_t)1 << (i & 63));
+    clear_info(l, i);
+    l->count++;
+    if (!l->on_chain) {
+      l->next_used = used_leaves;
+      used_leaves = l;
+      l->on_chain = 1;
+    }
+    if (++usage.mapped > usage.peak_mapped)
+      usage.peak_mapped = usage.mapped;
   } else {
-    if (!page->addr) {
+    if (!TEST_BIT(l, i)) {
       fprintf(stderr, "internal error: not currently mapped\n");
       abort();
     }
-    page->addr = NULL;
-    if (page->prev)
-      page->prev->next = page->next;
-    else
-      all_mapped_pages = page->next;
-    if (page->next)
-      page->next->prev = page->prev;
+    SET_BITS(l, i >> 6, l->bits[i >> 6] & ~((uint64_t)1 << (i & 63)));
+    clear_info(l, i);
+    l->count--;
+    usage.mapped--;
+  }
+}
+
+/* leaf_range - Check (apply == 0) or change (apply != 0) pages [i, i+n)
+   of a leaf a bitmap word at a time. A check returns the index of the
+   first page that is already in the requested state, or -1. */
+static long leaf_range(leaf *l, uintptr_t i, size_t n, int mapped, int apply) {
+  uintptr_t w, b, j;
+  uint64_t mask, bad;
+  size_t k;
+
+  while (n > 0) {
+    w = i >> 6;
+    b = i & 63;
+    k = (64 - b < n) ? 64 - b : n;
+    mask = ((k == 64) ? ~(uint64_t)0 : (((uint64_t)1 << k) - 1)) << b;
+    if (!apply) {
+      bad = (mapped ? l->bits[w] : ~l->bits[w]) & mask;
+      if (bad)
+        return (long)(w * 64 + __builtin_ctzll(bad));
+    } else {
+      if (mapped) {
+        SET_BITS(l, w, l->bits[w] | mask);
+        l->count += k;
+        usage.mapped += k;
+      } else {
+        SET_BITS(l, w, l->bits[w] & ~mask);
+        l->count -= k;
+        usage.mapped -= k;
+      }
+      for (j = i; j < i + k; j++)
+        clear_info(l, j);
+    }
+    i += k;
+    n -= k;
+  }
+  return -1;
+}
+
+void *pagemap_modify_range(void *p, size_t npages, int mapped) {
+  uintptr_t addr, i;
+  size_t left, n;
+  long bad;
+  leaf *l;
+  int apply;
+
+  /* First make sure every page can change, then change them */
+  for (apply = 0; apply < 2; apply++) {
+    for (addr = (uintptr_t)p, left = npages; left > 0;
+         addr += n << LOG_APAGE_SIZE, left -= n) {
+      i = PAGEMAP64_LEVEL3_BITS(addr);
+      n = (PAGEMAP64_LEVEL3_SIZE - i < left) ? PAGEMAP64_LEVEL3_SIZE - i : left;
+      l = find_leaf((void *)addr, mapped);
+      if (!l)
+        return (void *)addr;
+      bad = leaf_range(l, i, n, mapped, apply);
+      if (bad >= 0)
+        return (void *)(l->base + ((uintptr_t)bad << LOG_APAGE_SIZE));
+      if (apply && mapped && !l->on_chain) {
+        l->next_used = used_leaves;
+        used_leaves = l;
+        l->on_chain = 1;
+      }
+    }
   }
+
+  if (usage.mapped > usage.peak_mapped)
+    usage.peak_mapped = usage.mapped;
+  return NULL;
 }
 
 int pagemap_is_mapped(void *p) {
-  mpage **page_maps2;
-  mpage *page_maps3;
-
-  if (!page_maps1) return 0;
-  page_maps2 = page_maps1[PAGEMAP64_LEVEL1_BITS(p)];
-  if (!page_maps2) return 0;
-  page_maps3 = page_maps2[PAGEMAP64_LEVEL2_BITS(p)];
-  if (!page_maps3) return 0;
-  return !!page_maps3[PAGEMAP64_LEVEL3_BITS(p)].addr;
+  leaf *l = find_leaf(p, 0);
+  uintptr_t i = PAGEMAP64_LEVEL3_BITS(p);
+
+  return l && TEST_BIT(l, i);
+}
+
+void pagemap_set_info(void *p, uintptr_t info) {
+  leaf *l = find_leaf(p, 0);
+  uintptr_t i = PAGEMAP64_LEVEL3_BITS(p);
+  uintptr_t **group;
+
+  if (!l || !TEST_BIT(l, i)) {
+    fprintf(stderr, "internal error: setting info on unmapped page %p\n", p);
+    abort();
+  }
+  group = &l->info[i / INFO_GROUP_PAGES];
+  if (!*group) {
+    if (!info) return;
+    *group = pagemap_calloc(INFO_GROUP_PAGES, sizeof(uintptr_t), &usage.info);
+  }
+  (*group)[i % INFO_GROUP_PAGES] = info;
+}
+
+uintptr_t pagemap_get_info(void *p) {
+  leaf *l = find_leaf(p, 0);
+  uintptr_t i = PAGEMAP64_LEVEL3_BITS(p);
+
+  if (!l || !TEST_BIT(l, i) || !l->info[i / INFO_GROUP_PAGES])
+    return 0;
+  return l->info[i / INFO_GROUP_PAGES][i % INFO_GROUP_PAGES];
+}
+
+/* Tables are never freed, so a walk that skips last_leaf is safe */
+uintptr_t pagemap_peek_info(void *p) {
+  leaf **page_maps2;
+  leaf *l;
+  uintptr_t i = PAGEMAP64_LEVEL3_BITS(p);
+
+  if (!page_maps1 || !(page_maps2 = page_maps1[PAGEMAP64_LEVEL1_BITS(p)]))
+    return 0;
+  l = page_maps2[PAGEMAP64_LEVEL2_BITS(p)];
+  if (!l || !((__atomic_load_n(&l->bits[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1) ||
+      !l->info[i / INFO_GROUP_PAGES])
+    return 0;
+  return l->info[i / INFO_GROUP_PAGES][i % INFO_GROUP_PAGES];
 }
 
+/* Call f on every mapped page, unmarking each one as it goes */
 void pagemap_for_each(page_callback f) {
-  mpage *p, *next;
-  p = all_mapped_pages;
-  while (p) {
-    next = p->next;
-    f(p->addr);
-    pagemap_modify(p->addr, 0);
-    p = next;
+  leaf *l, *next;
+  uintptr_t w, i;
+  uint64_t bits;
+
+  for (l = used_leaves; l; l = next) {
+    next = l->next_used;
+    for (w = 0; l->count > 0 && w < BITMAP_WORDS; w++) {
+      while ((bits = l->bits[w]) != 0) {
+        i = w * 64 + __builtin_ctzll(bits);
+        f((void *)(l->base + (i << LOG_APAGE_SIZE)));
+        l->bits[w] &= bits - 1;
+        clear_info(l, i);
+        l->count--;
+        usage.mapped--;
+      }
+    }
+    l->next_used = NULL;
+    l->on_chain = 0;
+  }
+  used_leaves = NULL;
+}
+
+/* next_bit - index of the first page at or after i whose bit is set
+   (set != 0) or clear, or PAGEMAP64_LEVEL3_SIZE if there is none */
+static uintptr_t next_bit(leaf *l, uintptr_t i, int set) {
+  uintptr_t w = i >> 6;
+  uint64_t bits;
+
+  if (i >= PAGEMAP64_LEVEL3_SIZE)
+    return PAGEMAP64_LEVEL3_SIZE;
+  bits = (set ? l->bits[w] : ~l->bits[w]) & (~(uint64_t)0 << (i & 63));
+  while (!bits) {
+    if (++w == BITMAP_WORDS)
+      return PAGEMAP64_LEVEL3_SIZE;
+    bits = set ? l->bits[w] : ~l->bits[w];
   }
-  all_mapped_pages = NULL;
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+/* Call f once per maximal run of mapped pages, unmarking the run */
+void pagemap_for_each_run(run_callback f) {
+  leaf *l, *next;
+  uintptr_t start, end;
+
+  for (l = used_leaves; l; l = next) {
+    next = l->next_used;
+    for (start = next_bit(l, 0, 1); l->count > 0 && start < PAGEMAP64_LEVEL3_SIZE;
+         start = next_bit(l, end, 1)) {
+      end = next_bit(l, start, 0);
+      f((void *)(l->base + (start << LOG_APAGE_SIZE)),
+        (end - start) << LOG_APAGE_SIZE);
+      leaf_range(l, start, end - start, 0, 1);
+    }
+    l->next_used = NULL;
+    l->on_chain = 0;
+  }
+  used_leaves = NULL;
+}
+
+void pagemap_get_usage(pagemap_usage *u) {
+  *u = usage;
 }
@@ -1,10 +1,41 @@
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef void (*page_callback)(void *addr);
+typedef void (*run_callback)(void *addr, size_t len);
 
 void pagemap_modify(void *addr, int mapped);
 int pagemap_is_mapped(void *addr);
 void pagemap_for_each(page_callback f);
 
+/* Whole-run versions of pagemap_modify and pagemap_for_each. A range
+   change returns NULL, or leaves every page alone and returns the first
+   page that is already mapped (or unmapped). */
+void *pagemap_modify_range(void *addr, size_t npages, int mapped);
+void pagemap_for_each_run(run_callback f);
+
+/* Per-page metadata for the page's owner; 0 for unmapped or fresh pages */
+void pagemap_set_info(void *addr, uintptr_t info);
+uintptr_t pagemap_get_info(void *addr);
+
+/* pagemap_get_info without the lookup cache, so that threads may call it
+   while another changes the pagemap, as long as addr's own page is not
+   being changed */
+uintptr_t pagemap_peek_info(void *addr);
+
+/* What the pagemap's own bookkeeping costs */
+typedef struct {
+  size_t tables;      /* bytes of level-1 and level-2 tables */
+  size_t bitmaps;     /* bytes of level-3 leaves (page bitmaps) */
+  size_t info;        /* bytes of per-page info groups and the leaves'
+                         pointers to them */
+  size_t mapped;      /* pages mapped now */
+  size_t peak_mapped; /* most pages mapped at once */
+} pagemap_usage;
+
+void pagemap_get_usage(pagemap_usage *u);
+
 /* APAGE_SIZE needs to match the actual page size */
 #define LOG_APAGE_SIZE 12
 #define APAGE_SIZE (1 << LOG_APAGE_SIZE)
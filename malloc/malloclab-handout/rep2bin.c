@@ -0,0 +1,89 @@
+/*
+ * rep2bin.c - convert a text .rep trace into mdriver's binary format
+ *
+ * usage: rep2bin <in.rep> <out.bin>
+ *
+ * The binary trace is a tracefile_hdr followed by the traceop_t records
+ * (see tracefmt.h), which mdriver maps straight into memory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tracefmt.h"
+
+#define MAXLINE 1024
+
+static void convert_error(char *path, char *msg)
+{
+    fprintf(stderr, "rep2bin: %s: %s\n", path, msg);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    tracefile_hdr hdr;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size;
+    int op_index = 0;
+    unsigned max_index = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.rep> <out.bin>\n", argv[0]);
+        exit(1);
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL)
+        convert_error(argv[1], strerror(errno));
+    if ((out = fopen(argv[2], "wb")) == NULL)
+        convert_error(argv[2], strerror(errno));
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+               &hdr.num_ops, &hdr.weight) != 4)
+        convert_error(argv[1], "bad trace header");
+
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        convert_error(argv[2], strerror(errno));
+
+    while (fscanf(in, "%s", type) != EOF) {
+        memset(&op, 0, sizeof(op));
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(in, "%u %u", &index, &size) != 2)
+                convert_error(argv[1], "truncated alloc/realloc request");
+            op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+            op.index = index;
+            op.size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'f':
+            if (fscanf(in, "%u", &index) != 1)
+                convert_error(argv[1], "truncated free request");
+            op.type = FREE;
+            op.index = index;
+            break;
+        default:
+            convert_error(argv[1], "bogus type character");
+        }
+        if (fwrite(&op, sizeof(op), 1, out) != 1)
+            convert_error(argv[2], strerror(errno));
+        op_index++;
+    }
+
+    if (op_index != hdr.num_ops)
+        convert_error(argv[1], "op count does not match header");
+    if (hdr.num_ids == 0 || max_index != hdr.num_ids - 1)
+        convert_error(argv[1], "id count does not match header");
+
+    if (fclose(out) != 0)
+        convert_error(argv[2], strerror(errno));
+    fclose(in);
+
+    return 0;
+}
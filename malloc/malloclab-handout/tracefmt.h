@@ -0,0 +1,60 @@
+#ifndef __TRACEFMT_H_
+#define __TRACEFMT_H_
+
+/*
+ * tracefmt.h - trace records shared by mdriver and the trace tools
+ *
+ * Besides the text .rep format, a trace can be stored in binary form:
+ * a tracefile_hdr followed directly by num_ops traceop_t records in
+ * host byte order. mdriver maps such a file and uses the records in
+ * place, so even very large traces load without any parsing.
+ */
+#include <stdint.h>
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* First bytes of every binary trace */
+#define TRACE_MAGIC "MMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+/* Header of a binary trace; the same four numbers as a .rep header */
+typedef struct {
+    char magic[TRACE_MAGIC_LEN]; /* TRACE_MAGIC, not NUL-terminated */
+    int32_t sugg_heapsize;       /* suggested heap size (unused) */
+    int32_t num_ids;             /* number of alloc/realloc ids */
+    int32_t num_ops;             /* number of traceop_t records that follow */
+    int32_t weight;              /* weight for this trace (unused) */
+} tracefile_hdr;
+
+/*
+ * Raw capture files written by the libmmcapture.so LD_PRELOAD shim: a
+ * CAPTURE_MAGIC header followed by capture_rec records in per-thread
+ * batches. capture2bin sorts them by seq and turns them into a trace.
+ */
+#define CAPTURE_MAGIC "MMCAPT01"
+#define CAPTURE_MAGIC_LEN 8
+
+/* Kinds of capture_rec. A realloc is split in two records so that the
+   old block is released, and the new one claimed, at the right points
+   relative to calls made by other threads. */
+enum {
+    CAPTURE_ALLOC,         /* ptr = new block, size = requested bytes */
+    CAPTURE_FREE,          /* ptr = block being freed */
+    CAPTURE_REALLOC_BEGIN, /* ptr = block being resized */
+    CAPTURE_REALLOC_END    /* ptr = resulting block (0 if it failed), size */
+};
+
+typedef struct {
+    uint64_t seq;    /* global order of the call */
+    uint64_t ptr;    /* block address, see the CAPTURE_xxx kinds */
+    uint64_t size;   /* requested bytes for CAPTURE_ALLOC/REALLOC_END */
+    uint32_t type;   /* CAPTURE_xxx */
+    uint32_t thread; /* number of the calling thread, from 0 */
+} capture_rec;
+
+#endif /* __TRACEFMT_H_ */
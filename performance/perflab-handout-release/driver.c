@@ -26,6 +26,7 @@
 #include "fcyc.h"
 #include "defs.h"
 #include "config.h"
+#include "perfctr.h"
 
 /* Student structure that identifies the students */
 extern student_t student; 
@@ -50,6 +51,7 @@ typedef struct {
     motion_test_func motion_funct; /* The test function */
   };
     double cpes[DIM_CNT]; /* One CPE result for each dimension */
+    long long events[DIM_CNT][PERFCTR_NUM_EVENTS]; /* Event counts of one run (-P) */
     char *description;    /* ASCII description of the test function */
     unsigned short valid; /* The function is tested if this is non zero */
 } bench_t;
@@ -97,6 +99,10 @@ char *motion_maxmean_desc = NULL;
 int save_test_image_files;
 int save_all_image_files;
 
+/* If set, count hardware events over one more run of each kernel (-P) */
+static perfctr_set *counters = NULL;
+static perfctr_set event_counters;
+
 
 /******************** Functions begin *************************/
 
@@ -126,6 +132,29 @@ static int random_in_interval(int low, int high)
     return (rand()% size) + low;
 }
 
+/*
+ * print_events - One row per hardware event, giving the count of a run
+ * of the kernel per pixel at each dimension, or n/a if the event cannot
+ * be counted here
+ */
+static void print_events(bench_t *bench, int *dims)
+{
+    int i, event;
+    double work;
+
+    for (event = 0; event < PERFCTR_NUM_EVENTS; event++) {
+	printf("%s/px", perfctr_name(event));
+	for (i = 0; i < DIM_CNT; i++) {
+	    work = (double)dims[i] * dims[i];
+	    if (bench->events[i][event] >= 0)
+		printf("\t%.2f", bench->events[i][event] / work);
+	    else
+		printf("\tn/a");
+	}
+	printf("\n");
+    }
+}
+
 static int scale(int i, int from, int to) {
   return (int)(((double)i / from) * to);
 }
@@ -528,6 +557,14 @@ void test_complex(int bench_index)
 	    num_cycles = fcyc_v((test_funct_v)&complex_wrapper, arglist); 
 	    cpe = num_cycles/work;
 	    benchmarks_complex[bench_index].cpes[test_num] = cpe;
+
+	    /* Count events over a run as cold as those fcyc timed */
+	    if (counters) {
+		fcyc_clear_cache();
+		perfctr_start_set(counters);
+		run_complex_benchmark(bench_index, dim);
+		perfctr_stop_set(counters, benchmarks_complex[bench_index].events[test_num]);
+	    }
 	}
     }
 
@@ -552,6 +589,9 @@ void test_complex(int bench_index)
     }
     printf("\n");
 
+    if (counters)
+	print_events(&benchmarks_complex[bench_index], test_dim_complex);
+
     /* Compute Speedup */
     {
 	double prod, ratio, mean;
@@ -645,6 +685,14 @@ void test_motion(int bench_index)
             num_cycles = fcyc_v((test_funct_v)&motion_wrapper, arglist); 
 	    cpe = num_cycles/work;
 	    benchmarks_motion[bench_index].cpes[test_num] = cpe;
+
+	    /* Count events over a run as cold as those fcyc timed */
+	    if (counters) {
+		fcyc_clear_cache();
+		perfctr_start_set(counters);
+		run_motion_benchmark(bench_index, dim);
+		perfctr_stop_set(counters, benchmarks_motion[bench_index].events[test_num]);
+	    }
 	}
     }
 
@@ -667,6 +715,9 @@ void test_motion(int bench_index)
     }
     printf("\n");
 
+    if (counters)
+	print_events(&benchmarks_motion[bench_index], test_dim_motion);
+
     /* Compute speedup */
     {
 	double prod, ratio, mean;
@@ -700,7 +751,7 @@ void test_motion(int bench_index)
 
 void usage(char *progname) 
 {
-    fprintf(stderr, "Usage: %s [-hqg] [-f <func_file>] [-d <dump_file>]\n", progname);    
+    fprintf(stderr, "Usage: %s [-hqgP] [-f <func_file>] [-d <dump_file>]\n", progname);    
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -h         Print this message\n");
     fprintf(stderr, "  -i         Save test images as \".image\" files\n");
@@ -708,6 +759,7 @@ void usage(char *progname)
     fprintf(stderr, "  -m <mode>  Pick original image: gradient, squares, lines, or random\n");
     fprintf(stderr, "  -q         Quit after dumping (use with -d )\n");
     fprintf(stderr, "  -g         Autograder mode: checks only complex() and motion()\n");
+    fprintf(stderr, "  -P         Count cache, TLB and branch misses and instructions per pixel\n");
     fprintf(stderr, "  -f <file>  Get test function names from dump file <file>\n");
     fprintf(stderr, "  -d <file>  Emit a dump file <file> for later use with -f\n");
     exit(EXIT_FAILURE);
@@ -731,7 +783,7 @@ int main(int argc, char *argv[])
     register_motion_functions();
 
     /* parse command line args */
-    while ((c = getopt(argc, argv, "iIm:tgqf:d:s:h")) != -1)
+    while ((c = getopt(argc, argv, "iIm:tgqf:d:s:hP")) != -1)
 	switch (c) {
 
         case 'i':
@@ -773,6 +825,10 @@ int main(int argc, char *argv[])
 	    quit_after_dump = 1;
 	    break;
 
+	case 'P': /* count hardware events for each kernel */
+	    counters = &event_counters;
+	    break;
+
 	case 'f': /* get names of benchmark functions from this file */
 	    bench_func_file = strdup(optarg);
 	    break;
@@ -891,6 +947,9 @@ int main(int argc, char *argv[])
 	    benchmarks_motion[i].valid = 1;
     }
 
+    if (counters && perfctr_open_set(counters) == 0)
+	printf("No hardware event counters are available for -P\n");
+
     /* Set measurement (fcyc) parameters */
     set_fcyc_cache_size(1 << 14); /* 16 KB cache size */
     set_fcyc_clear_cache(1); /* clear the cache before each measurement */
@@ -909,6 +968,9 @@ int main(int argc, char *argv[])
     }
 
 
+    if (counters)
+	perfctr_close_set(counters);
+
     if (autograder) {
 	printf("\nbestscores:%.1f:%.1f:\n", complex_maxmean, motion_maxmean);
     }
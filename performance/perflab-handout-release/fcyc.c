@@ -107,6 +107,11 @@ static void clear()
   sink = x;
 }
 
+void fcyc_clear_cache(void)
+{
+  clear();
+}
+
 double fcyc(test_funct f, int *params)
 {
   double result;
@@ -11,6 +11,10 @@ typedef void (*test_funct_v)(void *);
 double fcyc(test_funct f, int* params);
 double fcyc_v(test_funct_v f, void* params[]);
 
+/* Clear the cache the way fcyc does before each measurement, e.g. to
+   take other measurements of a run under the same conditions */
+void fcyc_clear_cache(void);
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
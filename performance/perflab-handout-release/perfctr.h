@@ -0,0 +1,53 @@
+/*
+ * perfctr.h - hardware event counters through perf_event_open(2)
+ *
+ * Counters count user-mode events of the calling thread. On machines
+ * (or VMs, or containers) that do not expose an event, perfctr_open
+ * returns -1 and callers report the event as unavailable. When more
+ * counters are open than the PMU has, the kernel time-shares them and
+ * perfctr_stop scales the count up to the whole interval.
+ *
+ * malloc/malloclab-handout/perfctr.h is a copy of this file; keep the two the same.
+ */
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+enum perfctr_event {
+    PERFCTR_INSTRUCTIONS,  /* instructions retired */
+    PERFCTR_L1D_MISSES,    /* L1 data cache load misses */
+    PERFCTR_LLC_MISSES,    /* last-level cache load misses */
+    PERFCTR_DTLB_MISSES,   /* data TLB load misses */
+    PERFCTR_BRANCH_MISSES, /* mispredicted branches */
+    PERFCTR_NUM_EVENTS
+};
+
+/* A counter for every event, started and stopped together */
+typedef struct {
+    int fd[PERFCTR_NUM_EVENTS];
+} perfctr_set;
+
+/* Open a counter for event; returns a descriptor, or -1 if unavailable */
+int perfctr_open(int event);
+
+/* Zero and start a counter */
+void perfctr_start(int fd);
+
+/* Stop a counter and return its count, or -1 if it cannot be read */
+long long perfctr_stop(int fd);
+
+void perfctr_close(int fd);
+
+/* Short name of an event, for table headers */
+const char *perfctr_name(int event);
+
+/* Open every event; returns how many of them are available */
+int perfctr_open_set(perfctr_set *set);
+
+void perfctr_start_set(perfctr_set *set);
+
+/* Stop every counter, storing each count, or -1, in counts[event] */
+void perfctr_stop_set(perfctr_set *set, long long *counts);
+
+void perfctr_close_set(perfctr_set *set);
+
+#endif /* __PERFCTR_H_ */